@@ -0,0 +1,321 @@
+/*-
+ * Copyright (c) 2019 GANDI SAS
+ * All rights reserved.
+ *
+ * Author: Emmanuel Hocdet <manu@gandi.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <netinet/in.h>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <netdb.h>
+#include <resolv.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache/cache.h"
+
+#include "dns.h"
+
+/*
+ * Nameserver "ip" or "ip:port", IPv4, into sin if not NULL. -1 when
+ * invalid, anything after the port included.
+ */
+int
+dns_nameserver(const char *ns, struct sockaddr_in *sin)
+{
+	struct sockaddr_in sa;
+	const char *p;
+	char *ip, *end;
+	long port = NS_DEFAULTPORT;
+	int error;
+
+	AN(ns);
+	memset(&sa, 0, sizeof sa);
+	sa.sin_family = AF_INET;
+	p = strchr(ns, ':');
+	if (p != NULL) {
+		if (p[1] < '0' || p[1] > '9')
+			return (-1);
+		port = strtol(p + 1, &end, 10);
+		if (*end != '\0')
+			return (-1);
+		ip = strndup(ns, p - ns);
+	} else
+		ip = strdup(ns);
+	AN(ip);
+	error = port < 1 || port > 65535 ||
+	    inet_pton(AF_INET, ip, &sa.sin_addr) != 1;
+	free(ip);
+	if (error)
+		return (-1);
+	sa.sin_port = htons(port);
+	if (sin != NULL)
+		*sin = sa;
+	return (0);
+}
+
+/*
+ * A resolver state per lookup: res_ninit() reads resolv.conf, ns
+ * replaces its nameservers.
+ */
+static int
+dns_init(res_state rs, const char *ns)
+{
+	struct sockaddr_in sin;
+
+	memset(rs, 0, sizeof *rs);
+	if (res_ninit(rs))
+		return (-1);
+	if (ns == NULL || *ns == '\0')
+		return (0);
+	if (dns_nameserver(ns, &sin)) {
+		res_nclose(rs);
+		return (-1);
+	}
+	rs->nsaddr_list[0] = sin;
+	rs->nscount = 1;
+	return (0);
+}
+
+/*
+ * Query one type and call func on each answer of that type. The least
+ * TTL of the answer section (CNAMEs included) lowers *ttl. A name
+ * without data of that type is not an error.
+ */
+static int
+dns_query(res_state rs, const char *name, int type, double *ttl,
+	  void (*func)(void *, const ns_msg *, const ns_rr *), void *priv)
+{
+	unsigned char *buf;
+	ns_msg msg;
+	ns_rr rr;
+	int i, n;
+
+	buf = malloc(NS_MAXMSG);
+	AN(buf);
+	n = res_nquery(rs, name, ns_c_in, type, buf, NS_MAXMSG);
+	if (n < 0) {
+		free(buf);
+		return (rs->res_h_errno == NO_DATA ? 0 : -1);
+	}
+	if (ns_initparse(buf, n, &msg) < 0) {
+		free(buf);
+		return (-1);
+	}
+	for (i = 0; i < ns_msg_count(msg, ns_s_an); i++) {
+		if (ns_parserr(&msg, ns_s_an, i, &rr) < 0)
+			continue;
+		if (ns_rr_ttl(rr) < *ttl)
+			*ttl = ns_rr_ttl(rr);
+		if (ns_rr_class(rr) == ns_c_in && ns_rr_type(rr) == type)
+			func(priv, &msg, &rr);
+	}
+	free(buf);
+	return (0);
+}
+
+struct dns_addr {
+	const char		*port;
+	struct addrinfo		hints;
+	struct addrinfo		head;	/* ai_next: the results */
+	struct addrinfo		*tail;
+};
+
+static void
+dns_addr_rr(void *priv, const ns_msg *msg, const ns_rr *rr)
+{
+	struct dns_addr *da = priv;
+	struct addrinfo *res;
+	char ip[INET6_ADDRSTRLEN];
+	int af;
+
+	(void)msg;
+	if (ns_rr_type(*rr) == ns_t_a && ns_rr_rdlen(*rr) == NS_INADDRSZ)
+		af = AF_INET;
+	else if (ns_rr_type(*rr) == ns_t_aaaa &&
+	    ns_rr_rdlen(*rr) == NS_IN6ADDRSZ)
+		af = AF_INET6;
+	else
+		return;
+	AN(inet_ntop(af, ns_rr_rdata(*rr), ip, sizeof ip));
+	if (getaddrinfo(ip, da->port, &da->hints, &res))
+		return;
+	da->tail->ai_next = res;
+	while (da->tail->ai_next != NULL)
+		da->tail = da->tail->ai_next;
+}
+
+/* A and AAAA queries of name, results chained on port */
+static int
+dns_addr(res_state rs, const char *name, const char *port, double *ttl,
+	 struct addrinfo **res)
+{
+	struct dns_addr da;
+	int ra, raaaa;
+
+	memset(&da, 0, sizeof da);
+	da.port = port;
+	da.hints.ai_socktype = SOCK_STREAM;
+	da.hints.ai_family = AF_UNSPEC;
+	da.hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+	da.tail = &da.head;
+
+	ra = dns_query(rs, name, ns_t_a, ttl, dns_addr_rr, &da);
+	raaaa = dns_query(rs, name, ns_t_aaaa, ttl, dns_addr_rr, &da);
+	*res = da.head.ai_next;
+	return (ra && raaaa ? -1 : 0);
+}
+
+/*
+ * A and AAAA records of name, as getaddrinfo() results on port. *ttl is
+ * the least TTL of the answers, left unchanged without any.
+ */
+int
+dns_lookup_addr(const char *name, const char *port, const char *ns,
+		struct addrinfo **res, double *ttl, const char **err)
+{
+	struct __res_state rs;
+	double t = 1e9;
+	int error;
+
+	AN(name);
+	AN(res);
+	AN(ttl);
+	AN(err);
+	*res = NULL;
+	if (dns_init(&rs, ns)) {
+		*err = "resolver init or nameserver";
+		return (-1);
+	}
+	error = dns_addr(&rs, name, port, &t, res);
+	if (error)
+		*err = hstrerror(rs.res_h_errno);
+	res_nclose(&rs);
+	if (!error && t < 1e9)
+		*ttl = t;
+	return (error);
+}
+
+struct dns_srv_list {
+	struct dns_srv		*head;
+	struct dns_srv		**tail;
+};
+
+static void
+dns_srv_rr(void *priv, const ns_msg *msg, const ns_rr *rr)
+{
+	struct dns_srv_list *sl = priv;
+	struct dns_srv *srv;
+	const unsigned char *p;
+	char target[NS_MAXDNAME];
+
+	p = ns_rr_rdata(*rr);
+	if (ns_rr_rdlen(*rr) < 3 * NS_INT16SZ + 1)
+		return;
+	if (ns_name_uncompress(ns_msg_base(*msg), ns_msg_end(*msg),
+	    p + 3 * NS_INT16SZ, target, sizeof target) < 0)
+		return;
+	/* "." : the service is decidedly not available */
+	if (*target == '\0' || !strcmp(target, "."))
+		return;
+	srv = calloc(1, sizeof *srv);
+	AN(srv);
+	srv->priority = ns_get16(p);
+	srv->weight = ns_get16(p + NS_INT16SZ);
+	srv->port = ns_get16(p + 2 * NS_INT16SZ);
+	srv->target = strdup(target);
+	AN(srv->target);
+	*sl->tail = srv;
+	sl->tail = &srv->next;
+}
+
+/*
+ * SRV records of name, each with the addresses of its target. *ttl is
+ * the least TTL of the SRV and address answers. A target without
+ * address data is kept, with no res, but a failed address lookup fails
+ * the whole lookup so that the caller keeps its current backends.
+ */
+int
+dns_lookup_srv(const char *name, const char *ns, struct dns_srv **srvp,
+	       double *ttl, const char **err)
+{
+	struct __res_state rs;
+	struct dns_srv_list sl;
+	struct dns_srv *srv;
+	char port[6];
+	double t = 1e9;
+
+	AN(name);
+	AN(srvp);
+	AN(ttl);
+	AN(err);
+	*srvp = NULL;
+	if (dns_init(&rs, ns)) {
+		*err = "resolver init or nameserver";
+		return (-1);
+	}
+	sl.head = NULL;
+	sl.tail = &sl.head;
+	if (dns_query(&rs, name, ns_t_srv, &t, dns_srv_rr, &sl)) {
+		*err = hstrerror(rs.res_h_errno);
+		res_nclose(&rs);
+		return (-1);
+	}
+	for (srv = sl.head; srv != NULL; srv = srv->next) {
+		snprintf(port, sizeof port, "%u", srv->port);
+		if (dns_addr(&rs, srv->target, port, &t, &srv->res)) {
+			*err = hstrerror(rs.res_h_errno);
+			res_nclose(&rs);
+			dns_srv_free(sl.head);
+			return (-1);
+		}
+	}
+	res_nclose(&rs);
+	if (t < 1e9)
+		*ttl = t;
+	*srvp = sl.head;
+	return (0);
+}
+
+void
+dns_srv_free(struct dns_srv *srv)
+{
+	struct dns_srv *next;
+
+	for (; srv != NULL; srv = next) {
+		next = srv->next;
+		if (srv->res != NULL)
+			freeaddrinfo(srv->res);
+		free(srv->target);
+		free(srv);
+	}
+}
@@ -0,0 +1,54 @@
+/*-
+ * Copyright (c) 2019 GANDI SAS
+ * All rights reserved.
+ *
+ * Author: Emmanuel Hocdet <manu@gandi.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * DNS queries through libresolv, for the answers TTL that getaddrinfo()
+ * does not give.
+ */
+
+#ifndef UNIDIRECTORS_DNS_H
+#define UNIDIRECTORS_DNS_H
+
+struct addrinfo;
+struct sockaddr_in;
+
+struct dns_srv {
+	unsigned		priority;
+	unsigned		weight;
+	unsigned		port;
+	char			*target;
+	struct addrinfo		*res;	/* target addresses on port */
+	struct dns_srv		*next;
+};
+
+int dns_nameserver(const char *ns, struct sockaddr_in *sin);
+int dns_lookup_addr(const char *name, const char *port, const char *ns,
+		    struct addrinfo **res, double *ttl, const char **err);
+int dns_lookup_srv(const char *name, const char *ns, struct dns_srv **srv,
+		   double *ttl, const char **err);
+void dns_srv_free(struct dns_srv *srv);
+
+#endif /* UNIDIRECTORS_DNS_H */
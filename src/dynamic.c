@@ -34,6 +34,7 @@
 #include <sys/types.h>
 
 #include <errno.h>
+#include <math.h>
 #include <netdb.h>
 #include <pthread.h>
 #include <stdio.h>
@@ -45,12 +46,15 @@
 
 #include "vcl.h"
 #include "vsa.h"
+#include "vrnd.h"
 #include "vtim.h"
 #include "vsb.h"
 
 #include "vcc_if.h"
 #include "udir.h"
+#include "dns.h"
 #include "dynamic.h"
+#include "hash_fn.h"
 
 #define LOG(ctx, slt, obj, fmt, ...)		\
 	do {					\
@@ -82,36 +86,159 @@ static struct VSC_lck *lck_lookup;
 
 static unsigned loadcnt = 0;
 
+/*
+ * Lookups of all the dyndirectors are run by a small pool of threads
+ * shared by the VCLs. Scheduled lookups wait in a heap ordered by
+ * deadline, an idle thread sleeps until the earliest one.
+ */
+#ifndef LOOKUP_THREADS
+#define LOOKUP_THREADS		4
+#endif
+
+static struct {
+	struct lock		mtx;
+	pthread_cond_t		cond;	/* new deadline or stop */
+	pthread_cond_t		done;	/* a lookup ran */
+	struct dynamic_lookup	**heap;	/* [1..n_heap] */
+	unsigned		n_heap;
+	unsigned		l_heap;
+	pthread_t		thread[LOOKUP_THREADS];
+	unsigned		n_thread;
+	unsigned		stop;
+} lookup_pool;
+
+/*
+ * Backends of a dyndirector by address, so that an answer of n addresses
+ * is reconciled in O(n) and not by a list walk per address.
+ */
+static uint32_t
+backend_hash(const struct suckaddr *sa)
+{
+	const unsigned char *ip = NULL;
+	uint32_t key[5];
+	unsigned char *k = (unsigned char *)key;
+	unsigned port;
+	int len;
+
+	len = VRT_VSA_GetPtr(sa, &ip);
+	assert(len > 0 && len <= 16);
+	AN(ip);
+	memcpy(k, ip, len);
+	port = VSA_Port(sa);
+	k[len] = port >> 8;
+	k[len + 1] = port & 0xff;
+	return (MurmurHash3_32(k, len + 2, 0));
+}
+
+static struct backend_ip *
+backend_find(const struct vmod_unidirectors_dyndirector *dyn,
+	     const struct suckaddr *sa, uint32_t h)
+{
+	struct backend_ip *b;
+
+	if (dyn->htab == NULL)
+		return (NULL);
+	for (b = dyn->htab[h & dyn->hmask]; b != NULL; b = b->hnext)
+		if (b->hash == h && !VSA_Compare(b->ip_suckaddr, sa))
+			return (b);
+	return (NULL);
+}
+
+static void
+backend_hash_insert(struct vmod_unidirectors_dyndirector *dyn,
+		    struct backend_ip *b)
+{
+	struct backend_ip **htab, *b2, *next;
+	unsigned u, l;
+
+	/* load factor up to 1 */
+	if (dyn->htab == NULL || dyn->n_backends > dyn->hmask) {
+		l = dyn->htab == NULL ? 16 : 2 * (dyn->hmask + 1);
+		htab = calloc(l, sizeof *htab);
+		AN(htab);
+		for (u = 0; dyn->htab != NULL && u <= dyn->hmask; u++)
+			for (b2 = dyn->htab[u]; b2 != NULL; b2 = next) {
+				next = b2->hnext;
+				b2->hnext = htab[b2->hash & (l - 1)];
+				htab[b2->hash & (l - 1)] = b2;
+			}
+		free(dyn->htab);
+		dyn->htab = htab;
+		dyn->hmask = l - 1;
+	}
+	b->hnext = dyn->htab[b->hash & dyn->hmask];
+	dyn->htab[b->hash & dyn->hmask] = b;
+	dyn->n_backends++;
+}
+
+static void
+backend_hash_remove(struct vmod_unidirectors_dyndirector *dyn,
+		    struct backend_ip *b)
+{
+	struct backend_ip **bp;
+
+	AN(dyn->htab);
+	for (bp = &dyn->htab[b->hash & dyn->hmask]; *bp != b;
+	    bp = &(*bp)->hnext)
+		AN(*bp);
+	*bp = b->hnext;
+	b->hnext = NULL;
+	assert(dyn->n_backends > 0);
+	dyn->n_backends--;
+}
 
+
+/*
+ * A weight below 0 is unset: new backends get 1, known ones keep their
+ * weight and priority.
+ */
 static struct backend_ip *
 dynamic_add(VRT_CTX, struct vmod_unidirectors_dyndirector *dyn, struct suckaddr *sa,
-	    const char *ip, int af)
+	    const char *ip, int af, const char *port, double weight,
+	    unsigned priority)
 {
 	struct vrt_backend vrt;
 	struct backend_ip *b;
 	struct vsb *vsb;
 	struct dynamic_backend_vsc *c;
 	struct vsmw_cluster *vsc = NULL;
+	uint32_t h;
 
 	CHECK_OBJ_NOTNULL(dyn, VMOD_UNIDIRECTORS_DYNDIRECTOR_MAGIC);
-
-	VTAILQ_FOREACH(b, &dyn->backends, list) {
-		if (!VSA_Compare(b->ip_suckaddr, sa)) {
-			b->mark = dyn->mark;
-			return (NULL);
+	AN(port);
+
+	h = backend_hash(sa);
+	b = backend_find(dyn, sa, h);
+	if (b != NULL) {
+		b->mark = dyn->mark;
+		if (weight >= 0. && (b->weight != weight ||
+		    b->priority != priority)) {
+			b->weight = weight;
+			b->priority = priority;
+			b->changed = 1;
 		}
+		return (NULL);
 	}
 
 	b = calloc(1, sizeof *b);
 	AN(b);
+	b->hash = h;
 	b->mark = dyn->mark;
 	b->ip_suckaddr = sa;
 	b->ip_addr = strdup(ip);
 	AN(b->ip_addr);
+	b->port = strdup(port);
+	AN(b->port);
+	b->weight = weight >= 0. ? weight : 1.;
+	b->priority = weight >= 0. ? priority : 0;
 
 	vsb = VSB_new_auto();
 	AN(vsb);
-	VSB_printf(vsb, "%s(%s)", dyn->vd->vcl_name, b->ip_addr);
+	if (strcmp(port, dyn->port))
+		VSB_printf(vsb, "%s(%s:%s)", dyn->vd->vcl_name, b->ip_addr,
+		    port);
+	else
+		VSB_printf(vsb, "%s(%s)", dyn->vd->vcl_name, b->ip_addr);
 	AZ(VSB_finish(vsb));
 	b->vcl_name = strdup(VSB_data(vsb));
 	AN(b->vcl_name);
@@ -119,7 +246,7 @@ dynamic_add(VRT_CTX, struct vmod_unidirectors_dyndirector *dyn, struct suckaddr
 
 	INIT_OBJ(&vrt, VRT_BACKEND_MAGIC);
 	vrt.vcl_name = b->vcl_name;
-	vrt.port = dyn->port;
+	vrt.port = b->port;
 	vrt.probe = dyn->probe;
 	vrt.connect_timeout = dyn->connect_timeout;
 	vrt.first_byte_timeout = dyn->first_byte_timeout;
@@ -148,6 +275,7 @@ dynamic_add(VRT_CTX, struct vmod_unidirectors_dyndirector *dyn, struct suckaddr
 	DBG(ctx, dyn, "add-backend %s", b->vcl_name);
 
 	VTAILQ_INSERT_TAIL(&dyn->backends, b, list);
+	backend_hash_insert(dyn, b);
 	return (b);
 }
 
@@ -158,13 +286,15 @@ backend_fini(VRT_CTX, struct backend_ip *b)
 		VRT_delete_backend(ctx, &b->be);
 	free(b->vcl_name);
 	free(b->ip_addr);
+	free(b->port);
 	free(b->ip_suckaddr);
 	free(b);
 }
 
 static struct backend_ip *
 dynamic_add_addr(VRT_CTX, struct vmod_unidirectors_dyndirector *dyn, VCL_ACL acl,
-		    struct addrinfo *addr)
+		 struct addrinfo *addr, const char *port, double weight,
+		 unsigned priority)
 {
 	struct suckaddr *sa;
 	char ip[INET6_ADDRSTRLEN];
@@ -187,7 +317,8 @@ dynamic_add_addr(VRT_CTX, struct vmod_unidirectors_dyndirector *dyn, VCL_ACL acl
 		LOG(ctx, SLT_Error, dyn, "acl-mismatch %s", ip);
 	else {
 		struct backend_ip *b;
-		b = dynamic_add(ctx, dyn, sa, ip, addr->ai_family);
+		b = dynamic_add(ctx, dyn, sa, ip, addr->ai_family, port,
+		    weight, priority);
 		if (b)
 			return (b);
 	}
@@ -195,25 +326,29 @@ dynamic_add_addr(VRT_CTX, struct vmod_unidirectors_dyndirector *dyn, VCL_ACL acl
 	return (NULL);
 }
 
+/*
+ * An update is a begin, the addresses of the answer, and an end: the
+ * backends not seen since begin are removed.
+ */
 static void
-dynamic_update(VRT_CTX, struct vmod_unidirectors_dyndirector *dyn, VCL_ACL acl,
-	       struct addrinfo *addr)
+dynamic_update_begin(struct vmod_unidirectors_dyndirector *dyn)
 {
-	struct backend_ip *b, *b2;
-	struct vmod_unidirectors_director *vd;
-
 	CHECK_OBJ_NOTNULL(dyn, VMOD_UNIDIRECTORS_DYNDIRECTOR_MAGIC);
-	vd = dyn->vd;
-	CHECK_OBJ_NOTNULL(vd, VMOD_UNIDIRECTORS_DIRECTOR_MAGIC);
-
 	AZ(pthread_mutex_lock(&dyn->mtx));
 	dyn->mark++;
+}
 
+static void
+dynamic_update_addrs(VRT_CTX, struct vmod_unidirectors_dyndirector *dyn,
+		     VCL_ACL acl, struct addrinfo *addr, const char *port,
+		     double weight, unsigned priority)
+{
 	while (addr) {
 		switch (addr->ai_family) {
 		case AF_INET:
 		case AF_INET6:
-			dynamic_add_addr(ctx, dyn, acl, addr);
+			dynamic_add_addr(ctx, dyn, acl, addr, port, weight,
+			    priority);
 			break;
 		default:
 			DBG(ctx, dyn, "ignored family=%d", addr->ai_family);
@@ -221,24 +356,98 @@ dynamic_update(VRT_CTX, struct vmod_unidirectors_dyndirector *dyn, VCL_ACL acl,
 		}
 		addr = addr->ai_next;
 	}
+}
 
-	/* update unidirector */
-	udir_wrlock(vd);
-	VTAILQ_FOREACH_SAFE(b, &dyn->backends, list, b2)
-		if (b->mark != dyn->mark)
-			_udir_remove_backend(ctx, vd, b->be);
-		else if (!b->updated)
-			b->updated = _udir_add_backend(ctx, vd, b->be, 1);
-	udir_unlock(vd);
-
-	VTAILQ_FOREACH_SAFE(b, &dyn->backends, list, b2)
-		if (b->mark != dyn->mark) {
+static void
+dynamic_update_end(VRT_CTX, struct vmod_unidirectors_dyndirector *dyn)
+{
+	struct backend_ip *b, **bs;
+	struct udir_change *chg;
+	struct vmod_unidirectors_director *vd;
+	unsigned n = 0, u;
+
+	CHECK_OBJ_NOTNULL(dyn, VMOD_UNIDIRECTORS_DYNDIRECTOR_MAGIC);
+	vd = dyn->vd;
+	CHECK_OBJ_NOTNULL(vd, VMOD_UNIDIRECTORS_DIRECTOR_MAGIC);
+
+	/* the difference with the director: stale, new and changed ones */
+	chg = malloc((dyn->n_backends + 1) * sizeof *chg);
+	AN(chg);
+	bs = malloc((dyn->n_backends + 1) * sizeof *bs);
+	AN(bs);
+	VTAILQ_FOREACH(b, &dyn->backends, list) {
+		if (b->mark == dyn->mark && b->updated && !b->changed)
+			continue;
+		chg[n].be = b->be;
+		chg[n].weight = b->weight;
+		chg[n].priority = b->priority;
+		chg[n].remove = b->mark != dyn->mark;
+		bs[n++] = b;
+	}
+
+	/* update unidirector, one snapshot for the whole answer */
+	if (n > 0) {
+		udir_wrlock(vd);
+		_udir_change_backends(ctx, vd, chg, n);
+		udir_unlock(vd);
+	}
+
+	for (u = 0; u < n; u++) {
+		b = bs[u];
+		if (chg[u].remove) {
 			VTAILQ_REMOVE(&dyn->backends, b, list);
+			backend_hash_remove(dyn, b);
 			backend_fini(ctx, b);
+		} else {
+			b->updated |= chg[u].done;
+			b->changed = 0;
 		}
+	}
+	free(chg);
+	free(bs);
 	AZ(pthread_mutex_unlock(&dyn->mtx));
 }
 
+static void
+dynamic_update(VRT_CTX, struct vmod_unidirectors_dyndirector *dyn, VCL_ACL acl,
+	       struct addrinfo *addr)
+{
+	dynamic_update_begin(dyn);
+	dynamic_update_addrs(ctx, dyn, acl, addr, dyn->port, -1., 0);
+	dynamic_update_end(ctx, dyn);
+}
+
+/*
+ * SRV priorities are fallback tiers, shifted by one: priority 0 is no
+ * tier for the director. A target of weight 0 is only picked when all
+ * the targets of its priority have weight 0 (RFC 2782).
+ */
+static void
+dynamic_update_srv(VRT_CTX, struct vmod_unidirectors_dyndirector *dyn,
+		   VCL_ACL acl, const struct dns_srv *srv)
+{
+	const struct dns_srv *s, *s2;
+	char port[6];
+	double w;
+
+	dynamic_update_begin(dyn);
+	for (s = srv; s != NULL; s = s->next) {
+		w = s->weight;
+		if (w == 0.) {
+			for (s2 = srv; s2 != NULL; s2 = s2->next)
+				if (s2->priority == s->priority &&
+				    s2->weight > 0)
+					break;
+			if (s2 == NULL)
+				w = 1.;
+		}
+		snprintf(port, sizeof port, "%u", s->port);
+		dynamic_update_addrs(ctx, dyn, acl, s->res, port, w,
+		    s->priority + 1);
+	}
+	dynamic_update_end(ctx, dyn);
+}
+
 static void
 dynamic_timestamp(struct dynamic_lookup *dns, const char *event, double start,
 		  double dfirst, double dprev)
@@ -248,18 +457,24 @@ dynamic_timestamp(struct dynamic_lookup *dns, const char *event, double start,
 	    dfirst, dprev);
 }
 
-static void*
-lookup_thread(void *priv)
+/*
+ * Resolve and update the director, return the delay to the next lookup:
+ * the least TTL of the DNS answers within [ttl_min, ttl_max], or ttl
+ * without them. Less up to jitter of it, lookups of names sharing a TTL
+ * spread out instead of expiring together.
+ */
+static double
+lookup_run(struct dynamic_lookup *dns)
 {
 	struct vmod_unidirectors_dyndirector *dyn;
-	struct dynamic_lookup *dns;
-	struct addrinfo hints, *res;
+	struct addrinfo hints, *res = NULL;
+	struct dns_srv *srv = NULL;
 	struct vrt_ctx ctx;
-	double deadline, lookup, results, update;
+	double lookup, results, update, delay;
+	const char *err = NULL;
 	int error;
 
-	CAST_OBJ_NOTNULL(dns, priv, DYNAMIC_LOOKUP_MAGIC);
-
+	CHECK_OBJ_NOTNULL(dns, DYNAMIC_LOOKUP_MAGIC);
 	dyn = dns->dyn;
 	INIT_OBJ(&ctx, VRT_CTX_MAGIC);
 	ctx.vcl = dns->vcl;
@@ -269,57 +484,219 @@ lookup_thread(void *priv)
 	hints.ai_family = AF_UNSPEC;
 	hints.ai_flags = AI_NUMERICSERV;
 
-	while (dns->active) {
+	lookup = VTIM_real();
+	dynamic_timestamp(dns, "Lookup", lookup, 0., 0.);
+
+	/* can take a while, keep a look at dns->active */
+	delay = -1.;
+	if (dns->srv) {
+		error = dns_lookup_srv(dns->addr, dns->nameserver, &srv,
+		    &delay, &err);
+	} else if (dns->resolver == LOOKUP_DNS) {
+		error = dns_lookup_addr(dns->addr, dyn->port, dns->nameserver,
+		    &res, &delay, &err);
+	} else {
+		error = getaddrinfo(dns->addr, dyn->port, &hints, &res);
+		if (error)
+			err = gai_strerror(error);
+	}
+	if (error || delay < 0.)
+		delay = dns->ttl;
+	else if (delay < dns->ttl_min)
+		delay = dns->ttl_min;
+	else if (delay > dns->ttl_max)
+		delay = dns->ttl_max;
+
+	results = VTIM_real();
+	dynamic_timestamp(dns, "Results", results, results - lookup,
+	    results - lookup);
+
+	if (error)
+		LOG(&ctx, SLT_Error, dyn, "lookup %s fail (%s)", dns->addr, err);
+	else {
+		if (dns->active) {
+			if (dns->srv)
+				dynamic_update_srv(&ctx, dns->dyn,
+				    dns->whitelist, srv);
+			else
+				dynamic_update(&ctx, dns->dyn, dns->whitelist,
+				    res);
+			update = VTIM_real();
+			dynamic_timestamp(dns, "Update", update,
+					  update - lookup, update - results);
+		}
+		if (dns->srv)
+			dns_srv_free(srv);
+		else
+			freeaddrinfo(res);
+	}
+	DBG(&ctx, dyn, "next lookup of %s in %.3fs", dns->addr, delay);
+	return (delay * (1. - dns->jitter * scalbn(VRND_RandomTestable(), -31)));
+}
+
+/* binary heap on deadlines, lookup_pool.mtx held */
 
-		lookup = VTIM_real();
-		dynamic_timestamp(dns, "Lookup", lookup, 0., 0.);
+static void
+lookup_heap_set(unsigned i, struct dynamic_lookup *dns)
+{
+	lookup_pool.heap[i] = dns;
+	dns->heap_idx = i;
+}
 
-		/* can take a while, keep a look at dns->active */
-		error = getaddrinfo(dns->addr, dyn->port, &hints, &res);
+static void
+lookup_heap_up(unsigned i)
+{
+	struct dynamic_lookup *dns = lookup_pool.heap[i];
 
-		results = VTIM_real();
-		dynamic_timestamp(dns, "Results", results, results - lookup,
-		    results - lookup);
+	while (i > 1 && lookup_pool.heap[i / 2]->deadline > dns->deadline) {
+		lookup_heap_set(i, lookup_pool.heap[i / 2]);
+		i /= 2;
+	}
+	lookup_heap_set(i, dns);
+}
 
-		if (error)
-			LOG(&ctx, SLT_Error, dyn, "getaddrinfo %d (%s)",
-			    error, gai_strerror(error));
-		else {
-			if (dns->active) {
-				dynamic_update(&ctx, dns->dyn, dns->whitelist, res);
-				update = VTIM_real();
-				dynamic_timestamp(dns, "Update", update,
-						  update - lookup, update - results);
-			}
-			freeaddrinfo(res);
+static void
+lookup_heap_down(unsigned i)
+{
+	struct dynamic_lookup *dns = lookup_pool.heap[i];
+	unsigned c;
+
+	while ((c = 2 * i) <= lookup_pool.n_heap) {
+		if (c < lookup_pool.n_heap &&
+		    lookup_pool.heap[c + 1]->deadline <
+		    lookup_pool.heap[c]->deadline)
+			c++;
+		if (lookup_pool.heap[c]->deadline >= dns->deadline)
+			break;
+		lookup_heap_set(i, lookup_pool.heap[c]);
+		i = c;
+	}
+	lookup_heap_set(i, dns);
+}
+
+static void
+lookup_heap_insert(struct dynamic_lookup *dns)
+{
+	AZ(dns->heap_idx);
+	if (lookup_pool.n_heap + 1 >= lookup_pool.l_heap) {
+		lookup_pool.l_heap = lookup_pool.l_heap < 16 ? 16 :
+		    lookup_pool.l_heap * 2;
+		lookup_pool.heap = realloc(lookup_pool.heap,
+		    lookup_pool.l_heap * sizeof *lookup_pool.heap);
+		AN(lookup_pool.heap);
+	}
+	lookup_heap_set(++lookup_pool.n_heap, dns);
+	lookup_heap_up(dns->heap_idx);
+	/* a new earliest deadline */
+	if (dns->heap_idx == 1)
+		AZ(pthread_cond_broadcast(&lookup_pool.cond));
+}
+
+static void
+lookup_heap_delete(struct dynamic_lookup *dns)
+{
+	struct dynamic_lookup *last;
+	unsigned i;
+
+	i = dns->heap_idx;
+	assert(i > 0 && i <= lookup_pool.n_heap);
+	assert(lookup_pool.heap[i] == dns);
+	dns->heap_idx = 0;
+	last = lookup_pool.heap[lookup_pool.n_heap--];
+	if (last == dns)
+		return;
+	lookup_heap_set(i, last);
+	lookup_heap_up(i);
+	lookup_heap_down(last->heap_idx);
+}
+
+static void*
+lookup_thread(void *priv)
+{
+	struct dynamic_lookup *dns;
+	double now, delay;
+	int error;
+
+	AZ(priv);
+	Lck_Lock(&lookup_pool.mtx);
+	while (!lookup_pool.stop) {
+		dns = lookup_pool.n_heap > 0 ? lookup_pool.heap[1] : NULL;
+		if (dns == NULL) {
+			(void)Lck_CondWait(&lookup_pool.cond, &lookup_pool.mtx,
+			    0);
+			continue;
 		}
+		CHECK_OBJ_NOTNULL(dns, DYNAMIC_LOOKUP_MAGIC);
+		now = VTIM_real();
+		if (dns->deadline > now) {
+			error = Lck_CondWait(&lookup_pool.cond,
+			    &lookup_pool.mtx, dns->deadline);
+			assert(error == 0 || error == ETIMEDOUT);
+			continue;
+		}
+		lookup_heap_delete(dns);
+		dns->running = 1;
+		Lck_Unlock(&lookup_pool.mtx);
+
+		delay = lookup_run(dns);
 
+		Lck_Lock(&lookup_pool.mtx);
+		dns->running = 0;
 		if (dns->active && dns->ttl) {
-			Lck_Lock(&dns->mtx);
-			deadline = VTIM_real() + dns->ttl;
-			error = Lck_CondWait(&dns->cond, &dns->mtx, deadline);
-			assert(error == 0 || error == ETIMEDOUT);
-			Lck_Unlock(&dns->mtx);
+			dns->deadline = VTIM_real() + delay;
+			lookup_heap_insert(dns);
 		}
+		AZ(pthread_cond_broadcast(&lookup_pool.done));
 	}
-	dynamic_timestamp(dns, "Done", VTIM_real(), 0., 0.);
-
+	Lck_Unlock(&lookup_pool.mtx);
 	return (NULL);
 }
 
+static void
+lookup_pool_init(void)
+{
+	Lck_New(&lookup_pool.mtx, lck_lookup);
+	AZ(pthread_cond_init(&lookup_pool.cond, NULL));
+	AZ(pthread_cond_init(&lookup_pool.done, NULL));
+}
+
+/* last VCL gone: no lookup left */
+static void
+lookup_pool_fini(void)
+{
+	unsigned u;
+
+	Lck_Lock(&lookup_pool.mtx);
+	AZ(lookup_pool.n_heap);
+	lookup_pool.stop = 1;
+	AZ(pthread_cond_broadcast(&lookup_pool.cond));
+	Lck_Unlock(&lookup_pool.mtx);
+	for (u = 0; u < lookup_pool.n_thread; u++)
+		AZ(pthread_join(lookup_pool.thread[u], NULL));
+	lookup_pool.n_thread = 0;
+	lookup_pool.stop = 0;
+	free(lookup_pool.heap);
+	lookup_pool.heap = NULL;
+	lookup_pool.l_heap = 0;
+	AZ(pthread_cond_destroy(&lookup_pool.cond));
+	AZ(pthread_cond_destroy(&lookup_pool.done));
+	Lck_Delete(&lookup_pool.mtx);
+}
+
 static void
 lookup_free(VRT_CTX, struct dynamic_lookup *dns)
 {
 	CHECK_OBJ_ORNULL(ctx, VRT_CTX_MAGIC);
 	CHECK_OBJ_NOTNULL(dns, DYNAMIC_LOOKUP_MAGIC);
 
-	AZ(dns->thread);
-	AZ(pthread_cond_destroy(&dns->cond));
-	Lck_Delete(&dns->mtx);
+	AZ(dns->heap_idx);
+	AZ(dns->running);
 	free(dns->addr);
+	free(dns->nameserver);
 	FREE_OBJ(dns);
 }
 
+/* cancel a scheduled lookup, wait for a running one */
 static void
 lookup_stop(VRT_CTX, struct dynamic_lookup *dns)
 {
@@ -327,10 +704,13 @@ lookup_stop(VRT_CTX, struct dynamic_lookup *dns)
 	CHECK_OBJ_ORNULL(ctx, VRT_CTX_MAGIC);
 	CHECK_OBJ_NOTNULL(dns, DYNAMIC_LOOKUP_MAGIC);
 
-	AN(dns->thread);
-	AZ(pthread_cond_signal(&dns->cond));
-	AZ(pthread_join(dns->thread, NULL));
-	dns->thread = 0;
+	Lck_Lock(&lookup_pool.mtx);
+	dns->active = 0;
+	if (dns->heap_idx)
+		lookup_heap_delete(dns);
+	while (dns->running)
+		(void)Lck_CondWait(&lookup_pool.done, &lookup_pool.mtx, 0);
+	Lck_Unlock(&lookup_pool.mtx);
 
 	VRT_rel_vcl(ctx, &dns->vclref);
 }
@@ -345,8 +725,16 @@ lookup_start(VRT_CTX, struct dynamic_lookup *dns)
 	AZ(dns->vclref);
 	dns->vclref = VRT_ref_vcl(ctx, "DNS lookup");
 
-	AZ(dns->thread);
-	AZ(pthread_create(&dns->thread, NULL, &lookup_thread, dns));
+	Lck_Lock(&lookup_pool.mtx);
+	while (lookup_pool.n_thread < LOOKUP_THREADS) {
+		AZ(pthread_create(&lookup_pool.thread[lookup_pool.n_thread],
+		    NULL, &lookup_thread, NULL));
+		lookup_pool.n_thread++;
+	}
+	dns->active = 1;
+	dns->deadline = VTIM_real();
+	lookup_heap_insert(dns);
+	Lck_Unlock(&lookup_pool.mtx);
 }
 
 /*--------------------------------------------------------------------
@@ -388,6 +776,8 @@ vmod_dyndirector_event(VRT_CTX, struct vmod_priv *priv, enum vcl_event_e e)
 		if (loadcnt == 0) {
 			lck_lookup = Lck_CreateClass(&vcl_vsc->seg, "unidirector.lookup");
 			AN(lck_lookup);
+			lookup_pool_init();
+			udir_epoch_init();
 		}
 		loadcnt++;
 		return (0);
@@ -407,7 +797,9 @@ vmod_dyndirector_event(VRT_CTX, struct vmod_priv *priv, enum vcl_event_e e)
 				FREE_OBJ(c);
 			}
 		if (loadcnt == 0) {
+			lookup_pool_fini();
 			Lck_DestroyClass(&vcl_vsc->seg);
+			udir_epoch_fini();
 		}
 		return (0);
 	case VCL_EVENT_WARM:
@@ -422,7 +814,6 @@ vmod_dyndirector_event(VRT_CTX, struct vmod_priv *priv, enum vcl_event_e e)
 	VTAILQ_FOREACH(dns, &unidirectors_objects, list)
 		if (dns->vcl == ctx->vcl) {
 			assert(dns->active != active);
-			dns->active = active;
 			if (active)
 				lookup_start(ctx, dns);
 			else
@@ -495,18 +886,14 @@ vmod_dyndirector_add_IP(VRT_CTX, struct vmod_unidirectors_dyndirector *dyn,
 
 	error = getaddrinfo(ip, dyn->port, &hints, &addr);
 	if (!error) {
-		struct backend_ip *b;
 		switch (addr->ai_family) {
 		case AF_INET:
 		case AF_INET6:
+			/* same mark: a new weight, nothing removed */
 			AZ(pthread_mutex_lock(&dyn->mtx));
-			b = dynamic_add_addr(ctx, dyn, NULL, addr);
-			if (b) {
-				udir_wrlock(vd);
-				b->updated = _udir_add_backend(ctx, vd, b->be, w);
-				udir_unlock(vd);
-			}
-			AZ(pthread_mutex_unlock(&dyn->mtx));
+			(void)dynamic_add_addr(ctx, dyn, NULL, addr, dyn->port,
+			    w, 0);
+			dynamic_update_end(ctx, dyn);
 			break;
 		default:
 			DBG(ctx, dyn, "ignored family=%d", addr->ai_family);
@@ -539,7 +926,7 @@ vmod_dyndirector_remove_IP(VRT_CTX, struct vmod_unidirectors_dyndirector *dyn,
 
 	error = getaddrinfo(ip, dyn->port, &hints, &addr);
 	if (!error) {
-		struct backend_ip *b, *b2;
+		struct backend_ip *b;
 		struct suckaddr *sa;
 
 		switch (addr->ai_family) {
@@ -549,16 +936,16 @@ vmod_dyndirector_remove_IP(VRT_CTX, struct vmod_unidirectors_dyndirector *dyn,
 			AN(sa);
 			AN(VSA_Build(sa, addr->ai_addr, addr->ai_addrlen));
 			AZ(pthread_mutex_lock(&dyn->mtx));
-			VTAILQ_FOREACH_SAFE(b, &dyn->backends, list, b2)
-				if (!VSA_Compare(b->ip_suckaddr, sa)) {
-					VTAILQ_REMOVE(&dyn->backends, b, list);
-					udir_wrlock(vd);
-					_udir_remove_backend(ctx, vd, b->be);
-					udir_unlock(vd);
-					DBG(ctx, dyn, "remove-backend %s", b->vcl_name);
-					backend_fini(ctx, b);
-					break;
-				}
+			b = backend_find(dyn, sa, backend_hash(sa));
+			if (b != NULL) {
+				VTAILQ_REMOVE(&dyn->backends, b, list);
+				backend_hash_remove(dyn, b);
+				udir_wrlock(vd);
+				_udir_remove_backend(ctx, vd, b->be);
+				udir_unlock(vd);
+				DBG(ctx, dyn, "remove-backend %s", b->vcl_name);
+				backend_fini(ctx, b);
+			}
 			free(sa);
 			AZ(pthread_mutex_unlock(&dyn->mtx));
 			break;
@@ -573,10 +960,11 @@ vmod_dyndirector_remove_IP(VRT_CTX, struct vmod_unidirectors_dyndirector *dyn,
 	freeaddrinfo(addr);
 }
 
-VCL_VOID vmod_dyndirector_lookup_addr(VRT_CTX,  struct vmod_unidirectors_dyndirector *dyn,
-				      VCL_STRING addr,
-				      VCL_ACL whitelist,
-				      VCL_DURATION ttl)
+static void
+lookup_new(VRT_CTX, struct vmod_unidirectors_dyndirector *dyn,
+	   const char *meth, VCL_STRING addr, unsigned srv, VCL_ACL whitelist,
+	   VCL_DURATION ttl, VCL_ENUM resolver, VCL_STRING nameserver,
+	   VCL_DURATION ttl_min, VCL_DURATION ttl_max, VCL_REAL jitter)
 {
 	struct dynamic_lookup *dns;
 
@@ -585,7 +973,27 @@ VCL_VOID vmod_dyndirector_lookup_addr(VRT_CTX,  struct vmod_unidirectors_dyndire
 	CHECK_OBJ_ORNULL(whitelist, VRT_ACL_MAGIC);
 
 	if (ctx->method != VCL_MET_INIT) {
-		VSB_printf(ctx->msg, ".lookup_addr only in vcl_init (%s).", dyn->vd->vcl_name);
+		VSB_printf(ctx->msg, ".%s only in vcl_init (%s).", meth,
+		    dyn->vd->vcl_name);
+		VRT_handling(ctx, VCL_RET_FAIL);
+		return;
+	}
+	if (ttl_min > ttl_max || ttl_min < 0.) {
+		VSB_printf(ctx->msg, ".%s invalid ttl_min/ttl_max (%s).",
+		    meth, dyn->vd->vcl_name);
+		VRT_handling(ctx, VCL_RET_FAIL);
+		return;
+	}
+	if (jitter < 0. || jitter > 1.) {
+		VSB_printf(ctx->msg, ".%s jitter out of [0, 1] (%s).", meth,
+		    dyn->vd->vcl_name);
+		VRT_handling(ctx, VCL_RET_FAIL);
+		return;
+	}
+	if (nameserver != NULL && *nameserver != '\0' &&
+	    dns_nameserver(nameserver, NULL)) {
+		VSB_printf(ctx->msg, ".%s invalid nameserver %s (%s).", meth,
+		    nameserver, dyn->vd->vcl_name);
 		VRT_handling(ctx, VCL_RET_FAIL);
 		return;
 	}
@@ -594,14 +1002,47 @@ VCL_VOID vmod_dyndirector_lookup_addr(VRT_CTX,  struct vmod_unidirectors_dyndire
 	dns->addr =  strdup(addr);
 	dns->whitelist = whitelist;
 	dns->ttl = ttl;
+	dns->srv = srv;
+	if (srv || !strcmp(resolver, "dns"))
+		dns->resolver = LOOKUP_DNS;
+	if (nameserver != NULL && *nameserver != '\0')
+		dns->nameserver = strdup(nameserver);
+	dns->ttl_min = ttl_min;
+	dns->ttl_max = ttl_max;
+	dns->jitter = jitter;
 	dns->dyn = dyn;
 	dns->vcl = ctx->vcl;
-	Lck_New(&dns->mtx, lck_lookup);
-	AZ(pthread_cond_init(&dns->cond, NULL));
 
 	VTAILQ_INSERT_TAIL(&unidirectors_objects, dns, list);
 }
 
+VCL_VOID vmod_dyndirector_lookup_addr(VRT_CTX,  struct vmod_unidirectors_dyndirector *dyn,
+				      VCL_STRING addr,
+				      VCL_ACL whitelist,
+				      VCL_DURATION ttl,
+				      VCL_ENUM resolver,
+				      VCL_STRING nameserver,
+				      VCL_DURATION ttl_min,
+				      VCL_DURATION ttl_max,
+				      VCL_REAL jitter)
+{
+	lookup_new(ctx, dyn, "lookup_addr", addr, 0, whitelist, ttl,
+	    resolver, nameserver, ttl_min, ttl_max, jitter);
+}
+
+VCL_VOID vmod_dyndirector_lookup_srv(VRT_CTX,  struct vmod_unidirectors_dyndirector *dyn,
+				     VCL_STRING name,
+				     VCL_ACL whitelist,
+				     VCL_DURATION ttl,
+				     VCL_STRING nameserver,
+				     VCL_DURATION ttl_min,
+				     VCL_DURATION ttl_max,
+				     VCL_REAL jitter)
+{
+	lookup_new(ctx, dyn, "lookup_srv", name, 1, whitelist, ttl,
+	    "dns", nameserver, ttl_min, ttl_max, jitter);
+}
+
 VCL_VOID v_matchproto_()
 vmod_dynamics_number_expected(VRT_CTX, VCL_INT n)
 {
@@ -693,6 +1134,7 @@ vmod_dyndirector__fini(struct vmod_unidirectors_dyndirector **dynp)
 		backend_fini(NULL, b);
 	}
 	assert(VTAILQ_EMPTY(&dyn->backends));
+	free(dyn->htab);
 
 	free(dyn->port);
 	AZ(pthread_mutex_destroy(&dyn->mtx));
@@ -720,11 +1162,11 @@ vmod_dyndirector_backend(VRT_CTX, struct vmod_unidirectors_dyndirector *dyn)
 
 VCL_VOID v_matchproto_()
 vmod_dyndirector_add_backend(VRT_CTX, struct vmod_unidirectors_dyndirector *dyn,
-			     VCL_BACKEND be, double w)
+			     VCL_BACKEND be, double w, VCL_INT priority)
 {
         CHECK_OBJ_NOTNULL(ctx, VRT_CTX_MAGIC);
 	CHECK_OBJ_NOTNULL(dyn, VMOD_UNIDIRECTORS_DYNDIRECTOR_MAGIC);
-	return (vmod_director_add_backend(ctx, dyn->vd, be, w));
+	return (vmod_director_add_backend(ctx, dyn->vd, be, w, priority));
 }
 
 VCL_VOID v_matchproto_()
@@ -41,8 +41,14 @@ struct backend_ip {
 	struct suckaddr 		*ip_suckaddr;
 	char				*ip_addr;
 	char				*vcl_name;
+	char				*port;
+	double				weight;
+	unsigned			priority;
 	unsigned			mark;
 	unsigned			updated;
+	unsigned			changed;
+	uint32_t			hash;
+	struct backend_ip		*hnext;
 	VTAILQ_ENTRY(backend_ip)	list;
 };
 
@@ -61,6 +67,10 @@ struct vmod_unidirectors_dyndirector {
 	pthread_mutex_t		mtx;
 
 	VTAILQ_HEAD( ,backend_ip)	backends;
+	/* the same backends by address, chained, power of 2 buckets */
+	struct backend_ip	**htab;
+	unsigned		hmask;
+	unsigned		n_backends;
 
 	const char		*vcl_conf;
 	unsigned		mark;
@@ -74,9 +84,19 @@ struct dynamic_lookup {
 	char			*addr;
 	VCL_ACL			whitelist;
 	VCL_DURATION		ttl;
-	struct lock		mtx;
-	pthread_t		thread;
-	pthread_cond_t		cond;
+	unsigned		srv;
+	unsigned		resolver;
+#define LOOKUP_GETADDRINFO	0
+#define LOOKUP_DNS		1
+	char			*nameserver;
+	VCL_DURATION		ttl_min;
+	VCL_DURATION		ttl_max;
+	VCL_REAL		jitter;
+
+	/* lookup_pool.mtx */
+	double			deadline;
+	unsigned		heap_idx;	/* 0: not scheduled */
+	unsigned		running;
 
 	VTAILQ_ENTRY(dynamic_lookup)	list;
 	struct vcl		*vcl;
@@ -0,0 +1,194 @@
+/*-
+ * Copyright (c) 2019 GANDI SAS
+ * All rights reserved.
+ *
+ * Author: Emmanuel Hocdet <manu@gandi.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Epoch based reclamation
+ *
+ * Readers store the global epoch in a record private to their thread and
+ * never take a lock. A writer publishes a new object with one atomic
+ * exchange and retires the old one, tagged with the epoch of the swap. A
+ * retired object is freed once every active reader entered after it.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "cache/cache.h"
+
+#include "udir.h"
+
+struct epoch_rec {
+	uint64_t		epoch;
+	unsigned		nest;
+	unsigned		used;
+	struct epoch_rec	*next;
+} __attribute__((aligned(64)));
+
+struct epoch_retired {
+	uint64_t		epoch;
+	void			*ptr;
+	udir_epoch_free_f	*func;
+	struct epoch_retired	*next;
+};
+
+static pthread_mutex_t epoch_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t epoch_key;
+static uint64_t epoch_global = 1;
+static struct epoch_rec *epoch_recs;
+static struct epoch_retired *epoch_retired;
+
+static void
+epoch_rec_release(void *priv)
+{
+	struct epoch_rec *rec = priv;
+
+	AN(rec);
+	AZ(rec->nest);
+	AZ(pthread_mutex_lock(&epoch_mtx));
+	rec->used = 0;
+	AZ(pthread_mutex_unlock(&epoch_mtx));
+}
+
+static struct epoch_rec *
+epoch_rec_get(void)
+{
+	struct epoch_rec *rec;
+
+	rec = pthread_getspecific(epoch_key);
+	if (rec != NULL)
+		return (rec);
+	AZ(pthread_mutex_lock(&epoch_mtx));
+	for (rec = epoch_recs; rec != NULL; rec = rec->next)
+		if (!rec->used)
+			break;
+	if (rec == NULL) {
+		AZ(posix_memalign((void **)&rec, sizeof *rec, sizeof *rec));
+		memset(rec, 0, sizeof *rec);
+		rec->next = epoch_recs;
+		epoch_recs = rec;
+	}
+	rec->used = 1;
+	AZ(pthread_mutex_unlock(&epoch_mtx));
+	AZ(pthread_setspecific(epoch_key, rec));
+	return (rec);
+}
+
+/* free retired objects no reader can see anymore, epoch_mtx held */
+static void
+epoch_reclaim(void)
+{
+	struct epoch_rec *rec;
+	struct epoch_retired *r, **rp;
+	uint64_t e, min = UINT64_MAX;
+
+	for (rec = epoch_recs; rec != NULL; rec = rec->next) {
+		e = __atomic_load_n(&rec->epoch, __ATOMIC_SEQ_CST);
+		if (e != 0 && e < min)
+			min = e;
+	}
+	rp = &epoch_retired;
+	while ((r = *rp) != NULL) {
+		if (r->epoch < min) {
+			*rp = r->next;
+			r->func(r->ptr);
+			free(r);
+		} else
+			rp = &r->next;
+	}
+}
+
+void
+udir_epoch_enter(void)
+{
+	struct epoch_rec *rec;
+	uint64_t e;
+
+	rec = epoch_rec_get();
+	if (rec->nest++ > 0)
+		return;
+	e = __atomic_load_n(&epoch_global, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&rec->epoch, e, __ATOMIC_RELAXED);
+	/* the announce must be visible before any published pointer load */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void
+udir_epoch_leave(void)
+{
+	struct epoch_rec *rec;
+
+	rec = pthread_getspecific(epoch_key);
+	AN(rec);
+	assert(rec->nest > 0);
+	if (--rec->nest == 0)
+		__atomic_store_n(&rec->epoch, 0, __ATOMIC_RELEASE);
+}
+
+void
+udir_epoch_retire(void *ptr, udir_epoch_free_f *func)
+{
+	struct epoch_retired *r;
+
+	AN(func);
+	if (ptr == NULL)
+		return;
+	r = malloc(sizeof *r);
+	AN(r);
+	r->ptr = ptr;
+	r->func = func;
+	r->epoch = __atomic_fetch_add(&epoch_global, 1, __ATOMIC_SEQ_CST);
+	AZ(pthread_mutex_lock(&epoch_mtx));
+	r->next = epoch_retired;
+	epoch_retired = r;
+	epoch_reclaim();
+	AZ(pthread_mutex_unlock(&epoch_mtx));
+}
+
+void
+udir_epoch_init(void)
+{
+	AZ(pthread_key_create(&epoch_key, epoch_rec_release));
+}
+
+/* last VCL using the vmod is gone: no reader left */
+void
+udir_epoch_fini(void)
+{
+	struct epoch_rec *rec;
+
+	AZ(pthread_key_delete(epoch_key));
+	AZ(pthread_mutex_lock(&epoch_mtx));
+	while ((rec = epoch_recs) != NULL) {
+		AZ(rec->epoch);
+		epoch_recs = rec->next;
+		free(rec);
+	}
+	epoch_reclaim();
+	AZ(epoch_retired);
+	AZ(pthread_mutex_unlock(&epoch_mtx));
+}
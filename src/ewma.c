@@ -0,0 +1,200 @@
+/*-
+ * Copyright (c) 2019 GANDI SAS
+ * All rights reserved.
+ *
+ * Author: Emmanuel Hocdet <manu@gandi.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Peak EWMA: the cost of a backend is the moving average of its fetch
+ * durations, times the requests it has in flight plus one, divided by
+ * its weight. A slower sample replaces the average at once, faster ones
+ * lower it with the decay, and the average fades while no sample comes
+ * to give a slow backend a new chance. Picks are power of two choices.
+ */
+
+#include "config.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache/cache.h"
+#include "cache/cache_director.h"
+
+#include "vtim.h"
+
+#include "udir.h"
+#include "dynamic.h"
+
+/* cost of a backend in flight without any sample yet */
+#define EWMA_PENALTY		1e3
+
+struct vmod_director_ewma {
+	unsigned				magic;
+#define VMOD_DIRECTOR_EWMA_MAGIC		0x4e7a0b3d
+	double					decay;
+};
+
+static void v_matchproto_(vdi_destroy_f)
+ewma_vdi_destroy(VCL_BACKEND dir)
+{
+	struct vmod_unidirectors_director *vd;
+	struct vmod_director_ewma *ew;
+	CHECK_OBJ_NOTNULL(dir, DIRECTOR_MAGIC);
+	CAST_OBJ_NOTNULL(vd, dir->priv, VMOD_UNIDIRECTORS_DIRECTOR_MAGIC);
+	CAST_OBJ_NOTNULL(ew, vd->priv, VMOD_DIRECTOR_EWMA_MAGIC);
+	FREE_OBJ(ew);
+}
+
+static double
+ewma_cost(const struct udir_snapshot *snap, unsigned u, double decay,
+	  double now)
+{
+	struct udir_stat *st;
+	unsigned inflight;
+	double ewma, t;
+
+	st = snap->stat[u];
+	CHECK_OBJ_NOTNULL(st, UDIR_STAT_MAGIC);
+	inflight = __atomic_load_n(&st->inflight, __ATOMIC_RELAXED);
+	udir_stat_ewma(st, &ewma, &t);
+	if (ewma <= 0.0)
+		return (inflight > 0 ? EWMA_PENALTY * inflight : 0.0);
+	if (now > t)
+		ewma *= exp(-(now - t) / decay);
+	return (ewma * (inflight + 1) / snap->weight[u]);
+}
+
+/* snapshot index of the pick, -1 if none */
+static int
+ewma_select(const struct udir_snapshot *snap, const struct udir_healthy *hs,
+	    double decay, double now)
+{
+	unsigned a, b;
+
+	if (hs->n_backend == 0 || hs->tw <= 0.0)
+		return (-1);
+	a = udir_healthy_pick(hs, udir_random() * hs->tw);
+	if (hs->n_backend == 1)
+		return (hs->be_idx[a]);
+	b = udir_healthy_pick(hs, udir_random() * hs->tw);
+	/* always compare two distinct backends */
+	if (b == a)
+		b = (a + 1) % hs->n_backend;
+	a = hs->be_idx[a];
+	b = hs->be_idx[b];
+	assert(a < snap->n_backend);
+	assert(b < snap->n_backend);
+	if (b < a) {
+		/* ties go to the first added */
+		b ^= a;
+		a ^= b;
+		b ^= a;
+	}
+	if (ewma_cost(snap, b, decay, now) < ewma_cost(snap, a, decay, now))
+		return (b);
+	return (a);
+}
+
+static VCL_BACKEND v_matchproto_(vdi_resolve_f)
+ewma_vdi_resolve(VRT_CTX, VCL_BACKEND dir)
+{
+	struct vmod_unidirectors_director *vd;
+	const struct udir_snapshot *snap;
+	const struct udir_healthy *hs;
+	struct vmod_director_ewma *ew;
+	VCL_BACKEND rbe = NULL;
+	double now;
+	int u;
+
+	CHECK_OBJ_NOTNULL(ctx, VRT_CTX_MAGIC);
+	CHECK_OBJ_NOTNULL(dir, DIRECTOR_MAGIC);
+	CAST_OBJ_NOTNULL(vd, dir->priv, VMOD_UNIDIRECTORS_DIRECTOR_MAGIC);
+
+	snap = udir_enter(vd);
+	CAST_OBJ_NOTNULL(ew, vd->priv, VMOD_DIRECTOR_EWMA_MAGIC);
+	now = VTIM_real();
+	hs = udir_healthy_get(ctx, vd, snap);
+	u = ewma_select(snap, hs, ew->decay, now);
+	if (u >= 0 && !VRT_Healthy(ctx, snap->backend[u], NULL)) {
+		hs = udir_healthy_update(ctx, vd, snap, hs);
+		u = ewma_select(snap, hs, ew->decay, now);
+	}
+	if (u >= 0) {
+		rbe = snap->backend[u];
+		udir_task_track(ctx, vd, snap->stat[u], ew->decay, NULL);
+	}
+	udir_leave(vd);
+	return (rbe);
+}
+
+static const struct vdi_methods ewma_methods[1] = {{
+	.magic =		VDI_METHODS_MAGIC,
+	.type =			"ewma",
+	.healthy =		udir_vdi_healthy,
+	.resolve =		ewma_vdi_resolve,
+#ifdef HAVE_STRUCT_VDI_METHODS_FIND
+	.find =			udir_vdi_find,
+#endif
+#ifdef HAVE_STRUCT_VDI_METHODS_UPTIME
+	.uptime =		udir_vdi_uptime,
+#endif
+	.destroy =		ewma_vdi_destroy,
+	.list =                 udir_vdi_list,
+}};
+
+VCL_VOID v_matchproto_()
+vmod_director_ewma(VRT_CTX, struct vmod_unidirectors_director *vd, VCL_DURATION decay)
+{
+	struct vmod_director_ewma *ew;
+
+	CHECK_OBJ_NOTNULL(ctx, VRT_CTX_MAGIC);
+	CHECK_OBJ_NOTNULL(vd, VMOD_UNIDIRECTORS_DIRECTOR_MAGIC);
+
+	if (vd->dir) {
+		VRT_fail(ctx, "%s: LB method is already set", vd->vcl_name);
+		return;
+	}
+	if (decay <= 0.0) {
+		VRT_fail(ctx, "%s: ewma decay must be positive", vd->vcl_name);
+		return;
+	}
+	udir_wrlock(vd);
+
+	ALLOC_OBJ(ew, VMOD_DIRECTOR_EWMA_MAGIC);
+	vd->priv = ew;
+	AN(vd->priv);
+	ew->decay = decay;
+
+	vd->dir = VRT_AddDirector(ctx, ewma_methods, vd, "%s", vd->vcl_name);
+
+	udir_unlock(vd);
+}
+
+VCL_VOID v_matchproto_()
+vmod_dyndirector_ewma(VRT_CTX, struct vmod_unidirectors_dyndirector *dyn, VCL_DURATION decay)
+{
+	CHECK_OBJ_NOTNULL(ctx, VRT_CTX_MAGIC);
+	CHECK_OBJ_NOTNULL(dyn, VMOD_UNIDIRECTORS_DYNDIRECTOR_MAGIC);
+	vmod_director_ewma(ctx, dyn->vd, decay);
+}
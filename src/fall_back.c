@@ -40,17 +40,164 @@
 #include "cache/cache_director.h"
 
 #include "vsb.h"
+#include "vtim.h"
 
 #include "udir.h"
 #include "dynamic.h"
 
+/* seconds between two observations of the better tiers when damped */
+#define FB_OBSERVE			1.0
+
+/*
+ * Current tier and backend, immutable once published: the resolvers
+ * read it with one atomic load, a new one is swapped in on a switch and
+ * the old one reclaimed by epoch. A membership change carries it over to
+ * the new snapshot, see fb_remap().
+ */
+struct fb_cur {
+	unsigned			magic;
+#define FB_CUR_MAGIC			0x2c95a4d7
+	unsigned			gen;	/* of the snapshot */
+	unsigned			tier;
+	unsigned			priority;	/* of the tier */
+	VCL_BACKEND			be;
+	double				t_switch;
+};
+
 struct vmod_director_fallback {
 	unsigned			magic;
 #define VMOD_DIRECTOR_FALLBACK_MAGIC    0x4df34074
 	unsigned			sticky;
-	VCL_BACKEND			be;
+	double				min_healthy;
+	double				dwell;
+	unsigned			rise;
+	struct fb_cur			*cur;
+
+	pthread_mutex_t			mtx;	/* observations */
+	double				t_obs;
+	unsigned			rise_tier;
+	unsigned			rise_cnt;
 };
 
+#define fb_damped(fb) ((fb)->dwell > 0.0 || (fb)->rise > 1)
+
+/*
+ * Priority tiers, built per snapshot: backends sorted by priority then
+ * insertion order, a tier gathers the backends of the same priority.
+ * Priority 0 keeps a backend alone in its tier, so a director without
+ * priorities is the plain insertion order fallback.
+ */
+struct fb_tiers {
+	unsigned			magic;
+#define FB_TIERS_MAGIC			0x71c3e5a8
+	unsigned			n_tier;
+	unsigned			*start;	/* [n_tier + 1] */
+	be_idx_t			*order;
+	unsigned			*tier;	/* by snapshot index */
+};
+
+struct fb_key {
+	unsigned			priority;
+	be_idx_t			u;
+};
+
+static int
+fb_key_cmp(const void *a, const void *b)
+{
+	const struct fb_key *ka = a, *kb = b;
+
+	if (ka->priority != kb->priority)
+		return (ka->priority < kb->priority ? -1 : 1);
+	return (ka->u < kb->u ? -1 : ka->u > kb->u);
+}
+
+static void
+fb_tiers_free(void *priv)
+{
+	struct fb_tiers *ft;
+
+	CAST_OBJ_NOTNULL(ft, priv, FB_TIERS_MAGIC);
+	FREE_OBJ(ft);
+}
+
+static void * v_matchproto_(udir_snapshot_build_f)
+fb_tiers_build(const struct vmod_unidirectors_director *vd,
+	       const struct udir_snapshot *snap)
+{
+	struct fb_tiers *ft;
+	struct fb_key *key;
+	unsigned n, u, p;
+
+	CHECK_OBJ_NOTNULL(vd, VMOD_UNIDIRECTORS_DIRECTOR_MAGIC);
+	CHECK_OBJ_NOTNULL(snap, UDIR_SNAPSHOT_MAGIC);
+	n = snap->n_backend;
+	if (n == 0)
+		return (NULL);
+	ft = calloc(1, sizeof *ft + (n + 1) * sizeof *ft->start +
+	    n * sizeof *ft->tier + n * sizeof *ft->order);
+	AN(ft);
+	ft->magic = FB_TIERS_MAGIC;
+	ft->start = (void *)(ft + 1);
+	ft->tier = ft->start + n + 1;
+	ft->order = (void *)(ft->tier + n);
+	key = malloc(n * sizeof *key);
+	AN(key);
+	for (u = 0; u < n; u++) {
+		key[u].priority = snap->priority[u];
+		key[u].u = u;
+	}
+	qsort(key, n, sizeof *key, fb_key_cmp);
+	for (u = 0; u < n; u++)
+		ft->order[u] = key[u].u;
+	free(key);
+	for (u = 0; u < n; u++) {
+		p = snap->priority[ft->order[u]];
+		if (u == 0 || p == 0 || p != snap->priority[ft->order[u - 1]])
+			ft->start[ft->n_tier++] = u;
+		ft->tier[ft->order[u]] = ft->n_tier - 1;
+	}
+	ft->start[ft->n_tier] = n;
+	return (ft);
+}
+
+/*
+ * Weighted pick among the healthy backends of a tier, NULL if none. The
+ * tier is used if its healthy fraction is at least min_healthy or if
+ * force is set.
+ */
+static VCL_BACKEND
+fb_tier_pick(VRT_CTX, const struct udir_snapshot *snap,
+	     const struct fb_tiers *ft, unsigned t, double min_healthy,
+	     int force)
+{
+	unsigned i, u, nh = 0, n;
+	double hw = 0.0;
+	VCL_BACKEND be, rbe = NULL;
+
+	n = ft->start[t + 1] - ft->start[t];
+	for (i = ft->start[t]; i < ft->start[t + 1]; i++) {
+		u = ft->order[i];
+		be = snap->backend[u];
+		CHECK_OBJ_NOTNULL(be, DIRECTOR_MAGIC);
+		if (!VRT_Healthy(ctx, be, NULL))
+			continue;
+		if (nh++ == 0)
+			rbe = be;
+		if (n == 1 || snap->weight[u] <= 0.0)
+			continue;
+		hw += snap->weight[u];
+		/*
+		 * reservoir: each healthy backend kept with its weight share,
+		 * one draw per backend from the per thread PRNG, no lock
+		 */
+		if (udir_random() * hw < snap->weight[u])
+			rbe = be;
+	}
+	if (nh == 0 || (!force && nh < min_healthy * n))
+		return (NULL);
+	return (rbe);
+}
+
 static void v_matchproto_(vdi_destroy_f)
 fb_vdi_destroy(VCL_BACKEND dir)
 {
@@ -59,43 +206,191 @@ fb_vdi_destroy(VCL_BACKEND dir)
 	CHECK_OBJ_NOTNULL(dir, DIRECTOR_MAGIC);
 	CAST_OBJ_NOTNULL(vd, dir->priv, VMOD_UNIDIRECTORS_DIRECTOR_MAGIC);
 	CAST_OBJ_NOTNULL(fb, vd->priv, VMOD_DIRECTOR_FALLBACK_MAGIC);
+	free(fb->cur);
+	AZ(pthread_mutex_destroy(&fb->mtx));
 	FREE_OBJ(fb);
 }
 
+static struct fb_cur *
+fb_cur_new(const struct udir_snapshot *snap, const struct fb_tiers *ft,
+	   unsigned tier, VCL_BACKEND be, double t_switch)
+{
+	struct fb_cur *nc;
+
+	assert(tier < ft->n_tier);
+	ALLOC_OBJ(nc, FB_CUR_MAGIC);
+	AN(nc);
+	nc->gen = snap->gen;
+	nc->tier = tier;
+	nc->priority = snap->priority[ft->order[ft->start[tier]]];
+	nc->be = be;
+	nc->t_switch = t_switch;
+	return (nc);
+}
+
+static void
+fb_publish(struct vmod_director_fallback *fb, const struct udir_snapshot *snap,
+	   const struct fb_tiers *ft, unsigned tier, VCL_BACKEND be, double now)
+{
+	struct fb_cur *oc;
+
+	oc = __atomic_exchange_n(&fb->cur, fb_cur_new(snap, ft, tier, be, now),
+	    __ATOMIC_ACQ_REL);
+	udir_epoch_retire(oc, free);
+	AZ(pthread_mutex_lock(&fb->mtx));
+	fb->rise_cnt = 0;
+	AZ(pthread_mutex_unlock(&fb->mtx));
+}
+
+/*
+ * The backends changed: carry the current state over to the snapshot,
+ * on the tier of the current backend when it is still there, else on
+ * the tier of the same priority with a backend picked from it. The
+ * switch time and the rise observations are kept. NULL to start over.
+ * Published only for a newer snapshot, else valid until udir_leave().
+ */
+static const struct fb_cur *
+fb_remap(VRT_CTX, struct vmod_director_fallback *fb,
+	 const struct udir_snapshot *snap, const struct fb_tiers *ft,
+	 const struct fb_cur *cur)
+{
+	struct fb_cur *nc, *oc;
+	VCL_BACKEND be;
+	unsigned u, t;
+
+	for (u = 0; u < snap->n_backend; u++)
+		if (snap->backend[u] == cur->be)
+			break;
+	if (u < snap->n_backend) {
+		t = ft->tier[u];
+		be = cur->be;
+	} else {
+		if (cur->priority == 0)
+			return (NULL);
+		for (t = 0; t < ft->n_tier; t++)
+			if (snap->priority[ft->order[ft->start[t]]] ==
+			    cur->priority)
+				break;
+		if (t == ft->n_tier)
+			return (NULL);
+		be = fb_tier_pick(ctx, snap, ft, t, fb->min_healthy, 1);
+		if (be == NULL)
+			return (NULL);
+	}
+	nc = fb_cur_new(snap, ft, t, be, cur->t_switch);
+	oc = TRUST_ME(cur);
+	if ((int)(snap->gen - cur->gen) > 0 &&
+	    __atomic_compare_exchange_n(&fb->cur, &oc, nc, 0,
+	    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		udir_epoch_retire(oc, free);
+	else
+		udir_epoch_retire(nc, free);
+	return (nc);
+}
+
+/*
+ * Damped return to a better tier: not before dwell seconds on the current
+ * one, then once a better tier was seen usable on rise observations in a
+ * row, FB_OBSERVE seconds apart. One resolver observes at a time.
+ */
+static int
+fb_rise(VRT_CTX, struct vmod_director_fallback *fb,
+	const struct udir_snapshot *snap, const struct fb_tiers *ft,
+	const struct fb_cur *cur, double now, unsigned *tier)
+{
+	double t_obs;
+	unsigned t;
+	int r = 0;
+
+	if (now - cur->t_switch < fb->dwell)
+		return (0);
+	__atomic_load(&fb->t_obs, &t_obs, __ATOMIC_RELAXED);
+	if (now - t_obs < FB_OBSERVE || pthread_mutex_trylock(&fb->mtx))
+		return (0);
+	if (now - fb->t_obs >= FB_OBSERVE) {
+		__atomic_store(&fb->t_obs, &now, __ATOMIC_RELAXED);
+		for (t = 0; t < cur->tier; t++)
+			if (fb_tier_pick(ctx, snap, ft, t, fb->min_healthy, 0))
+				break;
+		if (t == cur->tier)
+			fb->rise_cnt = 0;
+		else {
+			if (t != fb->rise_tier)
+				fb->rise_cnt = 0;
+			fb->rise_tier = t;
+			if (++fb->rise_cnt >= fb->rise) {
+				*tier = t;
+				r = 1;
+			}
+		}
+	}
+	AZ(pthread_mutex_unlock(&fb->mtx));
+	return (r);
+}
+
 static VCL_BACKEND v_matchproto_(vdi_resolve_f)
 fallback_vdi_resolve(VRT_CTX, VCL_BACKEND dir)
 {
 	struct vmod_unidirectors_director *vd;
+	const struct udir_snapshot *snap;
 	struct vmod_director_fallback *fb;
-	unsigned u;
+	const struct fb_tiers *ft;
+	const struct fb_cur *cur;
+	unsigned t, n;
+	double now;
 	VCL_BACKEND be, rbe = NULL;
 
 	CHECK_OBJ_NOTNULL(ctx, VRT_CTX_MAGIC);
 	CHECK_OBJ_NOTNULL(dir, DIRECTOR_MAGIC);
 	CAST_OBJ_NOTNULL(vd, dir->priv, VMOD_UNIDIRECTORS_DIRECTOR_MAGIC);
 
-	udir_rdlock(vd);
+	snap = udir_enter(vd);
 	CAST_OBJ_NOTNULL(fb, vd->priv, VMOD_DIRECTOR_FALLBACK_MAGIC);
-	if (fb->sticky) {
-		be = fb->be;
-		for (u = 0; u < vd->n_backend; u++)
-			if (be == vd->backend[u]) {
-				CHECK_OBJ_NOTNULL(be, DIRECTOR_MAGIC);
-				if (VRT_Healthy(ctx, be, NULL))
-					rbe = be;
-				break;
+	CAST_OBJ(ft, snap->priv, FB_TIERS_MAGIC);
+	now = ctx->now > 0. ? ctx->now : VTIM_real();
+	cur = __atomic_load_n(&fb->cur, __ATOMIC_ACQUIRE);
+	CHECK_OBJ_ORNULL(cur, FB_CUR_MAGIC);
+	if (cur != NULL && ft == NULL)
+		cur = NULL;
+	else if (cur != NULL && cur->gen != snap->gen)
+		cur = fb_remap(ctx, fb, snap, ft, cur);
+	if (cur != NULL && fb->sticky) {
+		CHECK_OBJ_NOTNULL(cur->be, DIRECTOR_MAGIC);
+		if (VRT_Healthy(ctx, cur->be, NULL))
+			rbe = cur->be;
+	} else if (cur != NULL && fb_damped(fb)) {
+		rbe = fb_tier_pick(ctx, snap, ft, cur->tier, fb->min_healthy,
+		    0);
+		if (rbe != NULL && cur->tier > 0 &&
+		    fb_rise(ctx, fb, snap, ft, cur, now, &t)) {
+			be = fb_tier_pick(ctx, snap, ft, t, fb->min_healthy, 0);
+			if (be != NULL) {
+				rbe = be;
+				fb_publish(fb, snap, ft, t, rbe, now);
 			}
+		}
 	}
-	for (u = 0; rbe == NULL && u < vd->n_backend; u++) {
-		be = vd->backend[u];
-		CHECK_OBJ_NOTNULL(be, DIRECTOR_MAGIC);
-		if (VRT_Healthy(ctx, be, NULL))
-			fb->be = rbe = be;
+	if (rbe == NULL && ft != NULL) {
+		/* spill over the tiers under min_healthy, then take what is left */
+		n = ft->n_tier;
+		for (t = 0; rbe == NULL && t < ft->n_tier; t++)
+			if ((rbe = fb_tier_pick(ctx, snap, ft, t,
+			    fb->min_healthy, 0)) != NULL)
+				n = t;
+		for (t = 0; rbe == NULL && t < ft->n_tier; t++)
+			if ((rbe = fb_tier_pick(ctx, snap, ft, t,
+			    fb->min_healthy, 1)) != NULL)
+				n = t;
+		/* sticky holds on the backend, the others on the tier */
+		if (rbe != NULL && (cur == NULL || cur->tier != n ||
+		    (fb->sticky && cur->be != rbe)))
+			fb_publish(fb, snap, ft, n, rbe, now);
 	}
-	udir_unlock(vd);
+	udir_leave(vd);
 	return (rbe);
 }
 
+#ifdef HAVE_STRUCT_VDI_METHODS_UPTIME
 static VCL_BOOL v_matchproto_(vdi_uptime_f)
 fallback_vdi_uptime(VRT_CTX, VCL_BACKEND dir, VCL_TIME *changed, double *load)
 {
@@ -103,44 +398,50 @@ fallback_vdi_uptime(VRT_CTX, VCL_BACKEND dir, VCL_TIME *changed, double *load)
 	unsigned retval = 0;
 	double c = 0, l = 0;
 	struct vmod_unidirectors_director *vd;
+	const struct udir_snapshot *snap;
 	struct vmod_director_fallback *fb;
+	const struct fb_cur *cur;
 	VCL_BACKEND be;
 
 	CHECK_OBJ_NOTNULL(ctx, VRT_CTX_MAGIC);
 	CHECK_OBJ_NOTNULL(dir, DIRECTOR_MAGIC);
 	CAST_OBJ_NOTNULL(vd, dir->priv, VMOD_UNIDIRECTORS_DIRECTOR_MAGIC);
 
-	udir_rdlock(vd);
+	snap = udir_enter(vd);
 	CAST_OBJ_NOTNULL(fb, vd->priv, VMOD_DIRECTOR_FALLBACK_MAGIC);
-	if (fb->sticky) {
-		be = fb->be;
-		for (u = 0; u < vd->n_backend; u++)
-			if (be == vd->backend[u]) {
-				CHECK_OBJ_NOTNULL(be, DIRECTOR_MAGIC);
-				AN(be->vdir->methods->uptime);
-				retval = be->vdir->methods->uptime(ctx, be, &c, &l);
-				break;
-			}
+	cur = __atomic_load_n(&fb->cur, __ATOMIC_ACQUIRE);
+	/* the current backend, if still there */
+	for (u = 0; fb->sticky && cur != NULL && u < snap->n_backend; u++) {
+		be = snap->backend[u];
+		if (be != cur->be)
+			continue;
+		CHECK_OBJ_NOTNULL(be, DIRECTOR_MAGIC);
+		AN(be->vdir->methods->uptime);
+		retval = be->vdir->methods->uptime(ctx, be, &c, &l);
+		break;
 	}
-	for (u = 0; !retval && u < vd->n_backend; u++) {
-		be = vd->backend[u];
+	for (u = 0; !retval && u < snap->n_backend; u++) {
+		be = snap->backend[u];
 		CHECK_OBJ_NOTNULL(be, DIRECTOR_MAGIC);
 		AN(be->vdir->methods->uptime);
 		retval = be->vdir->methods->uptime(ctx, be, &c, &l);
 	}
-	udir_unlock(vd);
+	udir_leave(vd);
 	if (changed != NULL)
 		*changed = c;
 	if (load != NULL)
 		*load = l;
 	return (retval);
 }
+#endif
 
 static void v_matchproto_(vdi_list_f)
 fb_vdi_list(VRT_CTX, VCL_BACKEND dir, struct vsb *vsb, int pflag, int jflag)
 {
 	struct vmod_unidirectors_director *vd;
+	const struct udir_snapshot *snap;
 	struct vmod_director_fallback *fb;
+	const struct fb_cur *cur;
 	VCL_BACKEND be, cbe;
 	VCL_BOOL h;
 	unsigned u, nh = 0;
@@ -149,7 +450,7 @@ fb_vdi_list(VRT_CTX, VCL_BACKEND dir, struct vsb *vsb, int pflag, int jflag)
 	CHECK_OBJ_NOTNULL(dir, DIRECTOR_MAGIC);
 	CAST_OBJ_NOTNULL(vd, dir->priv, VMOD_UNIDIRECTORS_DIRECTOR_MAGIC);
 
-	udir_rdlock(vd);
+	snap = udir_enter(vd);
 	CAST_OBJ_NOTNULL(fb, vd->priv, VMOD_DIRECTOR_FALLBACK_MAGIC);
 	if (pflag) {
 		if (jflag) {
@@ -163,12 +464,14 @@ fb_vdi_list(VRT_CTX, VCL_BACKEND dir, struct vsb *vsb, int pflag, int jflag)
 			VSB_cat(vsb, "\n\n\tBackend\tCurrent\tHealth\n");
 		}
 	}
-	cbe = fb->be;
-	for (u = 0; u < vd->n_backend; u++) {
-		be = vd->backend[u];
+	cur = __atomic_load_n(&fb->cur, __ATOMIC_ACQUIRE);
+	/* only compared, it may not be in the snapshot anymore */
+	cbe = cur != NULL ? cur->be : NULL;
+	for (u = 0; u < snap->n_backend; u++) {
+		be = snap->backend[u];
 		CHECK_OBJ_NOTNULL(be, DIRECTOR_MAGIC);
 
-		h = VRT_Healthy(ctx, vd->backend[u], NULL);
+		h = VRT_Healthy(ctx, snap->backend[u], NULL);
 		if (h)
 			nh++;
 		if (!pflag)
@@ -201,8 +504,8 @@ fb_vdi_list(VRT_CTX, VCL_BACKEND dir, struct vsb *vsb, int pflag, int jflag)
 			VSB_cat(vsb, "\n");
 		}
 	}
-	u = vd->n_backend;
-	udir_unlock(vd);
+	u = snap->n_backend;
+	udir_leave(vd);
 
 	if (jflag && (pflag)) {
 		VSB_cat(vsb, "\n");
@@ -227,14 +530,19 @@ static const struct vdi_methods fallback_methods[1] = {{
 	.type =			"fallback",
 	.healthy =		udir_vdi_healthy,
 	.resolve =		fallback_vdi_resolve,
+#ifdef HAVE_STRUCT_VDI_METHODS_FIND
 	.find =			udir_vdi_find,
+#endif
+#ifdef HAVE_STRUCT_VDI_METHODS_UPTIME
 	.uptime =		fallback_vdi_uptime,
+#endif
 	.destroy =		fb_vdi_destroy,
 	.list =	                fb_vdi_list,
 }};
 
 VCL_VOID v_matchproto_()
-vmod_director_fallback(VRT_CTX, struct vmod_unidirectors_director *vd, VCL_BOOL sticky)
+vmod_director_fallback(VRT_CTX, struct vmod_unidirectors_director *vd, VCL_BOOL sticky,
+		       VCL_REAL min_healthy, VCL_DURATION dwell, VCL_INT rise)
 {
 	struct vmod_director_fallback *fb;
 
@@ -245,13 +553,30 @@ vmod_director_fallback(VRT_CTX, struct vmod_unidirectors_director *vd, VCL_BOOL
 		VRT_fail(ctx, "%s: LB method is already set", vd->vcl_name);
 		return;
 	}
+	if (min_healthy < 0.0 || min_healthy > 1.0) {
+		VRT_fail(ctx, "%s: min_healthy must be in [0, 1]",
+		    vd->vcl_name);
+		return;
+	}
+	if (dwell < 0.0 || rise < 1) {
+		VRT_fail(ctx, "%s: dwell must be positive and rise at least 1",
+		    vd->vcl_name);
+		return;
+	}
 	udir_wrlock(vd);
 
 	ALLOC_OBJ(fb, VMOD_DIRECTOR_FALLBACK_MAGIC);
 	vd->priv = fb;
 	AN(vd->priv);
 	fb->sticky = sticky;
-	fb->be = NULL;
+	fb->min_healthy = min_healthy;
+	fb->dwell = dwell;
+	fb->rise = rise;
+	AZ(pthread_mutex_init(&fb->mtx, NULL));
+	vd->snapshot_build = fb_tiers_build;
+	vd->snapshot_free = fb_tiers_free;
+	/* backends may already be there */
+	vd->dirty = 1;
 
 	vd->dir = VRT_AddDirector(ctx, fallback_methods, vd, "%s", vd->vcl_name);
 
@@ -259,9 +584,10 @@ vmod_director_fallback(VRT_CTX, struct vmod_unidirectors_director *vd, VCL_BOOL
 }
 
 VCL_VOID v_matchproto_()
-vmod_dyndirector_fallback(VRT_CTX, struct vmod_unidirectors_dyndirector *dyn, VCL_BOOL sticky)
+vmod_dyndirector_fallback(VRT_CTX, struct vmod_unidirectors_dyndirector *dyn, VCL_BOOL sticky,
+			  VCL_REAL min_healthy, VCL_DURATION dwell, VCL_INT rise)
 {
 	CHECK_OBJ_NOTNULL(ctx, VRT_CTX_MAGIC);
 	CHECK_OBJ_NOTNULL(dyn, VMOD_UNIDIRECTORS_DYNDIRECTOR_MAGIC);
-	vmod_director_fallback(ctx, dyn->vd, sticky);
+	vmod_director_fallback(ctx, dyn->vd, sticky, min_healthy, dwell, rise);
 }
@@ -42,69 +42,657 @@
 
 #include "udir.h"
 #include "dynamic.h"
+#include "hash_fn.h"
+
+enum hash_algorithm {
+	HASH_LINEAR = 0,
+	HASH_RING,
+	HASH_MAGLEV,
+	HASH_RENDEZVOUS,
+};
+
+/* where the key is taken from, see hash_src_parse() */
+enum hash_src_type {
+	HASH_SRC_URL = 0,
+	HASH_SRC_PATH,
+	HASH_SRC_HDR,
+	HASH_SRC_COOKIE,
+	HASH_SRC_QUERY,
+};
+
+struct hash_src {
+	enum hash_src_type	    type;
+	char			    *hdr;	/* http_GetHdr() format */
+	char			    *name;	/* cookie or query parameter */
+	size_t			    l_name;
+};
+
+enum hash_function {
+	HASH_FN_MURMUR3 = 0,
+	HASH_FN_XXH3,
+	HASH_FN_WYHASH,
+};
 
 struct vmod_director_hash {
 	unsigned		    magic;
 #define VMOD_DIRECTOR_HASH_MAGIC    0x1e98af01
-        char 			    *hdr;
+	unsigned		    n_src;
+	struct hash_src		    *src;
+	enum hash_algorithm	    algorithm;
+	unsigned		    vnodes;
+	unsigned		    fanout;
+	double			    max_load_factor;
+	enum hash_function	    function;
+};
+
+/*
+ * Bounded loads: a backend takes a key only while its in-flight load is
+ * under max_load_factor times its weighted share of the total load,
+ * otherwise the key goes on to the next candidate of the algorithm.
+ */
+struct hash_bound {
+	double			    cap;	/* per unit of weight, 0: none */
+};
+
+/* consistent hash ring of weighted virtual nodes, built per snapshot */
+struct hash_point {
+	uint32_t		    hash;
+	be_idx_t		    u;
 };
 
-/* MurmurHash3_32 */
-static inline uint32_t getblock(const uint32_t * p, int i) {
-	return ntohl(p[i]);
+struct hash_ring {
+	unsigned		    magic;
+#define HASH_RING_MAGIC		    0x2a7c90e4
+	unsigned		    n_point;
+	struct hash_point	    *point;
+};
+
+/* fetches in flight through this director */
+static double
+hash_load(const struct udir_snapshot *snap, unsigned u)
+{
+	CHECK_OBJ_NOTNULL(snap->stat[u], UDIR_STAT_MAGIC);
+	return (__atomic_load_n(&snap->stat[u]->inflight, __ATOMIC_RELAXED));
 }
-static inline uint32_t rotl32(uint32_t x, int8_t r) {
-	return (x << r) | (x >> (32 - r));
+
+/* from the director total, not a sum over the backends */
+static void
+hash_bound_init(struct hash_bound *hb, const struct vmod_director_hash *rr,
+		const struct vmod_unidirectors_director *vd,
+		const struct udir_healthy *hs)
+{
+	double tl;
+
+	hb->cap = 0.0;
+	if (rr->max_load_factor <= 0.0 || hs->tw <= 0.0)
+		return;
+	tl = __atomic_load_n(&vd->inflight, __ATOMIC_RELAXED);
+	hb->cap = rr->max_load_factor * (tl + 1) / hs->tw;
 }
-static inline uint32_t fmix(uint32_t h)
+
+/* healthy and under its bound */
+static int
+hash_bound_fits(const struct hash_bound *hb, const struct udir_snapshot *snap,
+		const struct udir_healthy *hs, unsigned u)
 {
-	h ^= h >> 16;
-	h *= 0x85ebca6b;
-	h ^= h >> 13;
-	h *= 0xc2b2ae35;
-	h ^= h >> 16;
-	return h;
+	assert(u < snap->n_backend);
+	if (!udir_healthy_test(hs, u))
+		return (0);
+	if (hb->cap <= 0.0)
+		return (1);
+	return (hash_load(snap, u) <
+		hb->cap * snap->weight[u]);
 }
 
-static uint32_t
-MurmurHash3_32(const void *key, int len, uint32_t seed)
+static int
+hash_point_cmp(const void *a, const void *b)
+{
+	const struct hash_point *pa = a, *pb = b;
+
+	if (pa->hash != pb->hash)
+		return (pa->hash < pb->hash ? -1 : 1);
+	return (pa->u < pb->u ? -1 : pa->u > pb->u);
+}
+
+static void
+hash_ring_free(void *priv)
+{
+	struct hash_ring *ring;
+
+	CAST_OBJ_NOTNULL(ring, priv, HASH_RING_MAGIC);
+	free(ring->point);
+	FREE_OBJ(ring);
+}
+
+/*
+ * Each backend gets vnodes points scaled by its weight over the mean
+ * weight. Points are keyed on the backend name, not its position, so the
+ * ring does not move when other backends come and go.
+ */
+static void * v_matchproto_(udir_snapshot_build_f)
+hash_ring_build(const struct vmod_unidirectors_director *vd,
+		const struct udir_snapshot *snap)
+{
+	struct vmod_director_hash *rr;
+	struct hash_ring *ring;
+	const char *name;
+	unsigned u, v, nv, l, n = 0;
+	double tw = 0.0, mean;
+
+	CHECK_OBJ_NOTNULL(vd, VMOD_UNIDIRECTORS_DIRECTOR_MAGIC);
+	CHECK_OBJ_NOTNULL(snap, UDIR_SNAPSHOT_MAGIC);
+	CAST_OBJ_NOTNULL(rr, vd->priv, VMOD_DIRECTOR_HASH_MAGIC);
+
+	for (u = 0; u < snap->n_backend; u++)
+		if (snap->weight[u] > 0.0) {
+			tw += snap->weight[u];
+			n++;
+		}
+	if (n == 0)
+		return (NULL);
+	mean = tw / n;
+
+	ALLOC_OBJ(ring, HASH_RING_MAGIC);
+	AN(ring);
+	l = 0;
+	for (u = 0; u < snap->n_backend; u++) {
+		if (snap->weight[u] <= 0.0)
+			continue;
+		nv = lround(rr->vnodes * snap->weight[u] / mean);
+		if (nv == 0)
+			nv = 1;
+		if (ring->n_point + nv > l) {
+			l = (ring->n_point + nv) * 2;
+			ring->point = realloc(ring->point, l * sizeof *ring->point);
+			AN(ring->point);
+		}
+		name = snap->backend[u]->vcl_name;
+		for (v = 0; v < nv; v++) {
+			ring->point[ring->n_point].hash =
+			    MurmurHash3_32(name, strlen(name), v);
+			ring->point[ring->n_point].u = u;
+			ring->n_point++;
+		}
+	}
+	qsort(ring->point, ring->n_point, sizeof *ring->point, hash_point_cmp);
+	return (ring);
+}
+
+/* first healthy point clockwise from key, snapshot index or -1 */
+static int
+hash_ring_select(const struct hash_bound *hb, const struct udir_snapshot *snap,
+		 const struct udir_healthy *hs, uint32_t key)
+{
+	const struct hash_ring *ring;
+	const struct hash_point *p;
+	unsigned lo, hi, mid, i, first = UDIR_MAX_BACKEND;
+
+	if (hs->n_backend == 0 || snap->priv == NULL)
+		return (-1);
+	CAST_OBJ_NOTNULL(ring, snap->priv, HASH_RING_MAGIC);
+	lo = 0;
+	hi = ring->n_point;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (ring->point[mid].hash < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (i = 0; i < ring->n_point; i++) {
+		if (lo == ring->n_point)
+			lo = 0;
+		p = &ring->point[lo++];
+		assert(p->u < snap->n_backend);
+		if (first == UDIR_MAX_BACKEND && udir_healthy_test(hs, p->u))
+			first = p->u;
+		if (hash_bound_fits(hb, snap, hs, p->u))
+			return (p->u);
+	}
+	/* loads moved under us, keep the owner */
+	if (first != UDIR_MAX_BACKEND)
+		return (first);
+	return (-1);
+}
+
+/*
+ * Maglev lookup table, built per snapshot. The table size is a prime
+ * taken from a fixed ladder to stay stable across membership changes
+ * (a new size remaps every key), with at least 100 entries per backend.
+ */
+static const unsigned hash_maglev_sizes[] = { 65537, 655373, 6553621 };
+
+struct hash_maglev {
+	unsigned		    magic;
+#define HASH_MAGLEV_MAGIC	    0x51d2c8a3
+	unsigned		    size;
+	be_idx_t		    *table;
+};
+
+static void
+hash_maglev_free(void *priv)
 {
-	const uint8_t *data = (const uint8_t *)key;
-	const int nblocks = len / 4;
+	struct hash_maglev *mg;
 
-	uint32_t h1 = seed;
-	uint32_t c1 = 0xcc9e2d51;
-	uint32_t c2 = 0x1b873593;
+	CAST_OBJ_NOTNULL(mg, priv, HASH_MAGLEV_MAGIC);
+	FREE_OBJ(mg);
+}
+
+static void * v_matchproto_(udir_snapshot_build_f)
+hash_maglev_build(const struct vmod_unidirectors_director *vd,
+		  const struct udir_snapshot *snap)
+{
+	struct hash_maglev *mg;
+	const char *name;
+	uint32_t *offset, *skip, *next;
+	double *credit, tw = 0.0;
+	unsigned u, c, m, filled, n = 0;
 
-	const uint32_t *blocks = (const uint32_t *)(data + nblocks*4);
-	for (int i = -nblocks; i; i++) {
-		uint32_t k1 = getblock(blocks, i);
-		k1 *= c1;
-		k1 = rotl32(k1, 15);
-		k1 *= c2;
-		h1 ^= k1;
-		h1 = rotl32(h1, 13);
-		h1 = h1 * 5 + 0xe6546b64;
+	CHECK_OBJ_NOTNULL(vd, VMOD_UNIDIRECTORS_DIRECTOR_MAGIC);
+	CHECK_OBJ_NOTNULL(snap, UDIR_SNAPSHOT_MAGIC);
+
+	for (u = 0; u < snap->n_backend; u++)
+		if (snap->weight[u] > 0.0) {
+			tw += snap->weight[u];
+			n++;
+		}
+	if (n == 0)
+		return (NULL);
+	for (u = 0; u < sizeof hash_maglev_sizes / sizeof *hash_maglev_sizes; u++) {
+		m = hash_maglev_sizes[u];
+		if (m >= 100 * n)
+			break;
 	}
 
-	const uint8_t *tail = (const uint8_t*)(data + nblocks*4);
-	uint32_t k1 = 0;
-	switch(len & 3) {
-	case 3: k1 ^= tail[2] << 16;
-	case 2: k1 ^= tail[1] << 8;
-	case 1: k1 ^= tail[0];
-		k1 *= c1;
-		k1 = rotl32(k1, 15);
-		k1 *= c2;
-		h1 ^= k1;
-	};
+	mg = calloc(1, sizeof *mg + m * sizeof *mg->table);
+	AN(mg);
+	mg->magic = HASH_MAGLEV_MAGIC;
+	mg->size = m;
+	mg->table = (void *)(mg + 1);
+	for (c = 0; c < m; c++)
+		mg->table[c] = UDIR_MAX_BACKEND;
 
-	h1 ^= len;
-	h1 = fmix(h1);
+	offset = malloc(snap->n_backend * 3 * sizeof *offset);
+	AN(offset);
+	skip = offset + snap->n_backend;
+	next = skip + snap->n_backend;
+	credit = calloc(snap->n_backend, sizeof *credit);
+	AN(credit);
+	for (u = 0; u < snap->n_backend; u++) {
+		name = snap->backend[u]->vcl_name;
+		offset[u] = MurmurHash3_32(name, strlen(name), 0xa) % m;
+		skip[u] = MurmurHash3_32(name, strlen(name), 0xb) % (m - 1) + 1;
+		next[u] = 0;
+	}
+
+	/*
+	 * Backends take turns in their permutation, weighted by credits.
+	 * A turn gives n * weight / total credits, so that each pass fills
+	 * about n entries however skewed the weights are.
+	 */
+	filled = 0;
+	while (filled < m) {
+		for (u = 0; u < snap->n_backend && filled < m; u++) {
+			if (snap->weight[u] <= 0.0)
+				continue;
+			credit[u] += snap->weight[u] * n / tw;
+			while (credit[u] >= 1.0 && filled < m) {
+				credit[u] -= 1.0;
+				do {
+					c = (offset[u] +
+					    (uint64_t)next[u] * skip[u]) % m;
+					next[u]++;
+				} while (mg->table[c] != UDIR_MAX_BACKEND);
+				mg->table[c] = u;
+				filled++;
+			}
+		}
+	}
+	free(credit);
+	free(offset);
+	return (mg);
+}
 
-	return h1;
+/* one modulo and one index, probe further only for a sick backend */
+static int
+hash_maglev_select(const struct hash_bound *hb, const struct udir_snapshot *snap,
+		   const struct udir_healthy *hs, uint32_t key)
+{
+	const struct hash_maglev *mg;
+	unsigned c, step, i, u, first = UDIR_MAX_BACKEND;
+
+	if (hs->n_backend == 0 || snap->priv == NULL)
+		return (-1);
+	CAST_OBJ_NOTNULL(mg, snap->priv, HASH_MAGLEV_MAGIC);
+	c = key % mg->size;
+	step = fmix(key) % (mg->size - 1) + 1;
+	for (i = 0; i < 2 * snap->n_backend; i++) {
+		u = mg->table[c];
+		assert(u < snap->n_backend);
+		if (first == UDIR_MAX_BACKEND && udir_healthy_test(hs, u))
+			first = u;
+		if (hash_bound_fits(hb, snap, hs, u))
+			return (u);
+		c = (c + step) % mg->size;
+	}
+	if (first != UDIR_MAX_BACKEND)
+		return (first);
+	/* mostly sick pool, spread over what is left */
+	return (hs->be_idx[key % hs->n_backend]);
+}
+
+/*
+ * Weighted rendezvous hashing: the key goes to the node with the highest
+ * score -w / ln(h), h uniform in ]0, 1[ from the key and the node seed.
+ * Leaves are the backends. With a fanout, leaves are grouped into a
+ * skeleton tree and a lookup descends it, scoring fanout nodes per
+ * level. Without, the root holds every leaf. The tree is built per
+ * snapshot, healthy leaf counts per node with the healthy set.
+ */
+struct hash_hrw_node {
+	uint32_t		    seed;
+	double			    weight;
+	unsigned		    child;	/* first child, backend for a leaf */
+	unsigned		    n_child;	/* 0 for a leaf */
+};
+
+struct hash_hrw {
+	unsigned		    magic;
+#define HASH_HRW_MAGIC		    0x0e6b3f58
+	unsigned		    n_node;
+	unsigned		    root;
+	struct hash_hrw_node	    *node;
+};
+
+static void
+hash_hrw_free(void *priv)
+{
+	struct hash_hrw *hrw;
+
+	CAST_OBJ_NOTNULL(hrw, priv, HASH_HRW_MAGIC);
+	FREE_OBJ(hrw);
+}
+
+static void * v_matchproto_(udir_snapshot_build_f)
+hash_hrw_build(const struct vmod_unidirectors_director *vd,
+	       const struct udir_snapshot *snap)
+{
+	struct vmod_director_hash *rr;
+	struct hash_hrw *hrw;
+	struct hash_hrw_node *nd;
+	const char *name;
+	unsigned u, lo, hi, f, n = 0;
+
+	CHECK_OBJ_NOTNULL(vd, VMOD_UNIDIRECTORS_DIRECTOR_MAGIC);
+	CHECK_OBJ_NOTNULL(snap, UDIR_SNAPSHOT_MAGIC);
+	CAST_OBJ_NOTNULL(rr, vd->priv, VMOD_DIRECTOR_HASH_MAGIC);
+
+	for (u = 0; u < snap->n_backend; u++)
+		if (snap->weight[u] > 0.0)
+			n++;
+	if (n == 0)
+		return (NULL);
+	f = rr->fanout > 1 ? rr->fanout : n;
+
+	/* leaves, then at most as many internal nodes */
+	hrw = calloc(1, sizeof *hrw + 2 * n * sizeof *hrw->node);
+	AN(hrw);
+	hrw->magic = HASH_HRW_MAGIC;
+	hrw->node = (void *)(hrw + 1);
+	for (u = 0; u < snap->n_backend; u++) {
+		if (snap->weight[u] <= 0.0)
+			continue;
+		nd = &hrw->node[hrw->n_node++];
+		name = snap->backend[u]->vcl_name;
+		nd->seed = MurmurHash3_32(name, strlen(name), 0);
+		nd->weight = snap->weight[u];
+		nd->child = u;
+	}
+	lo = 0;
+	hi = hrw->n_node;
+	while (hi - lo > 1) {
+		for (u = lo; u < hi; u += f) {
+			assert(hrw->n_node < 2 * n);
+			nd = &hrw->node[hrw->n_node];
+			nd->seed = fmix(0x9e3779b9 * (hrw->n_node + 1));
+			nd->child = u;
+			nd->n_child = hi - u < f ? hi - u : f;
+			for (unsigned c = 0; c < nd->n_child; c++)
+				nd->weight += hrw->node[u + c].weight;
+			hrw->n_node++;
+		}
+		lo = hi;
+		hi = hrw->n_node;
+	}
+	hrw->root = lo;
+	return (hrw);
+}
+
+/* healthy leaves under each node, children come before their parent */
+static void * v_matchproto_(udir_healthy_build_f)
+hash_hrw_healthy_build(const struct vmod_unidirectors_director *vd,
+		       const struct udir_snapshot *snap,
+		       const struct udir_healthy *hs)
+{
+	const struct hash_hrw *hrw;
+	const struct hash_hrw_node *nd;
+	unsigned *up, i, c;
+
+	CHECK_OBJ_NOTNULL(vd, VMOD_UNIDIRECTORS_DIRECTOR_MAGIC);
+	CHECK_OBJ_NOTNULL(snap, UDIR_SNAPSHOT_MAGIC);
+	CHECK_OBJ_NOTNULL(hs, UDIR_HEALTHY_MAGIC);
+	if (snap->priv == NULL || hs->n_backend == 0)
+		return (NULL);
+	CAST_OBJ_NOTNULL(hrw, snap->priv, HASH_HRW_MAGIC);
+	up = calloc(hrw->n_node, sizeof *up);
+	AN(up);
+	for (i = 0; i < hrw->n_node; i++) {
+		nd = &hrw->node[i];
+		if (nd->n_child == 0)
+			up[i] = udir_healthy_test(hs, nd->child) ? 1 : 0;
+		for (c = 0; c < nd->n_child; c++)
+			up[i] += up[nd->child + c];
+	}
+	return (up);
+}
+
+static int
+hash_hrw_select(const struct hash_bound *hb, const struct udir_snapshot *snap,
+		const struct udir_healthy *hs, uint32_t key)
+{
+	const struct hash_hrw *hrw;
+	const struct hash_hrw_node *nd;
+	const unsigned *up;
+	unsigned i, c, best, fit;
+	double h, score, max, max_fit;
+
+	if (snap->priv == NULL || hs->priv == NULL)
+		return (-1);
+	CAST_OBJ_NOTNULL(hrw, snap->priv, HASH_HRW_MAGIC);
+	up = hs->priv;
+	i = hrw->root;
+	if (up[i] == 0)
+		return (-1);
+	while (hrw->node[i].n_child > 0) {
+		nd = &hrw->node[i];
+		best = fit = nd->child;
+		max = max_fit = -INFINITY;
+		for (c = nd->child; c < nd->child + nd->n_child; c++) {
+			if (up[c] == 0)
+				continue;
+			h = (fmix(key ^ hrw->node[c].seed) + 0.5) * 0x1p-32;
+			score = -hrw->node[c].weight / log(h);
+			if (score > max) {
+				max = score;
+				best = c;
+			}
+			/* bounds are only applied among sibling leaves */
+			if (hb->cap > 0.0 && hrw->node[c].n_child == 0 &&
+			    score > max_fit &&
+			    hash_bound_fits(hb, snap, hs, hrw->node[c].child)) {
+				max_fit = score;
+				fit = c;
+			}
+		}
+		i = max_fit > -INFINITY ? fit : best;
+	}
+	assert(hrw->node[i].child < snap->n_backend);
+	return (hrw->node[i].child);
+}
+
+/* header name in http_GetHdr() format: length, name and ':' */
+static char *
+hash_hdr_new(const char *name, size_t l)
+{
+	char *hdr;
+
+	assert(l > 0 && l < 255);
+	hdr = malloc(l + 3);
+	AN(hdr);
+	hdr[0] = l + 1;
+	memcpy(hdr + 1, name, l);
+	hdr[l + 1] = ':';
+	hdr[l + 2] = '\0';
+	return (hdr);
+}
+
+static void
+hash_src_free(struct vmod_director_hash *rr)
+{
+	unsigned u;
+
+	for (u = 0; u < rr->n_src; u++) {
+		free(rr->src[u].hdr);
+		free(rr->src[u].name);
+	}
+	free(rr->src);
+	rr->src = NULL;
+	rr->n_src = 0;
+}
+
+/*
+ * Comma separated list of key sources:
+ *   url		the whole URL
+ *   url.path		the URL without the query string
+ *   http.NAME		a header
+ *   cookie.NAME	a cookie of the Cookie header
+ *   query.NAME		a parameter of the query string
+ */
+static int
+hash_src_parse(VRT_CTX, const struct vmod_unidirectors_director *vd,
+	       struct vmod_director_hash *rr, const char *key)
+{
+	struct hash_src *src;
+	const char *b, *e, *n;
+	size_t l;
+
+	for (b = key; *b != '\0'; b = e) {
+		while (*b == ',' || *b == ' ' || *b == '\t')
+			b++;
+		if (*b == '\0')
+			break;
+		for (e = b; *e != '\0' && *e != ',' && *e != ' ' &&
+		    *e != '\t'; e++)
+			continue;
+		rr->src = realloc(rr->src, (rr->n_src + 1) * sizeof *rr->src);
+		AN(rr->src);
+		src = &rr->src[rr->n_src++];
+		memset(src, 0, sizeof *src);
+		n = memchr(b, '.', e - b);
+		l = n == NULL ? 0 : e - n - 1;
+		if (e - b == 3 && !strncmp(b, "url", 3))
+			src->type = HASH_SRC_URL;
+		else if (e - b == 8 && !strncmp(b, "url.path", 8))
+			src->type = HASH_SRC_PATH;
+		else if (l > 0 && l < 254 && n - b == 4 && !strncmp(b, "http", 4)) {
+			src->type = HASH_SRC_HDR;
+			src->hdr = hash_hdr_new(n + 1, l);
+		} else if (l > 0 && n - b == 6 && !strncmp(b, "cookie", 6)) {
+			src->type = HASH_SRC_COOKIE;
+			src->hdr = hash_hdr_new("Cookie", 6);
+			src->name = strndup(n + 1, l);
+			AN(src->name);
+			src->l_name = l;
+		} else if (l > 0 && n - b == 5 && !strncmp(b, "query", 5)) {
+			src->type = HASH_SRC_QUERY;
+			src->name = strndup(n + 1, l);
+			AN(src->name);
+			src->l_name = l;
+		} else {
+			VRT_fail(ctx, "%s: invalid hash key source '%.*s'",
+				 vd->vcl_name, (int)(e - b), b);
+			hash_src_free(rr);
+			return (-1);
+		}
+	}
+	return (0);
+}
+
+/* value of NAME in "NAME=value" items of [b, e) separated by sep */
+static int
+hash_src_param(const char *b, const char *e, char sep, const char *name,
+	       size_t l, const char **pp, size_t *lp)
+{
+	const char *q;
+
+	while (b < e) {
+		while (b < e && (*b == sep || *b == ' '))
+			b++;
+		q = memchr(b, sep, e - b);
+		if (q == NULL)
+			q = e;
+		if ((size_t)(q - b) > l && b[l] == '=' && !memcmp(b, name, l)) {
+			*pp = b + l + 1;
+			*lp = q - *pp;
+			return (1);
+		}
+		b = q;
+	}
+	return (0);
+}
+
+/* point into the request, nothing is copied */
+static int
+hash_src_get(VRT_CTX, const struct hash_src *src, const char **pp, size_t *lp)
+{
+	const char *b, *e, *q;
+
+	AN(ctx->http_bereq);
+	b = ctx->http_bereq->hd[HTTP_HDR_URL].b;
+	e = ctx->http_bereq->hd[HTTP_HDR_URL].e;
+	switch (src->type) {
+	case HASH_SRC_URL:
+		*pp = b;
+		*lp = e - b;
+		return (1);
+	case HASH_SRC_PATH:
+		q = memchr(b, '?', e - b);
+		*pp = b;
+		*lp = (q == NULL ? e : q) - b;
+		return (1);
+	case HASH_SRC_HDR:
+		if (!http_GetHdr(ctx->bo->bereq, src->hdr, pp))
+			return (0);
+		*lp = strlen(*pp);
+		return (1);
+	case HASH_SRC_COOKIE:
+		if (!http_GetHdr(ctx->bo->bereq, src->hdr, &b))
+			return (0);
+		return (hash_src_param(b, b + strlen(b), ';', src->name,
+		    src->l_name, pp, lp));
+	case HASH_SRC_QUERY:
+		q = memchr(b, '?', e - b);
+		if (q == NULL)
+			return (0);
+		b = q + 1;
+		q = memchr(b, '#', e - b);
+		return (hash_src_param(b, q == NULL ? e : q, '&', src->name,
+		    src->l_name, pp, lp));
+	default:
+		WRONG("hash key source");
+	}
+	return (0);
 }
-/* MurmurHash3_32 */
 
 static void v_matchproto_(vdi_destroy_f)
 hash_vdi_destroy(VCL_BACKEND dir)
@@ -114,20 +702,115 @@ hash_vdi_destroy(VCL_BACKEND dir)
 	CHECK_OBJ_NOTNULL(dir, DIRECTOR_MAGIC);
 	CAST_OBJ_NOTNULL(vd, dir->priv, VMOD_UNIDIRECTORS_DIRECTOR_MAGIC);
 	CAST_OBJ_NOTNULL(rr, vd->priv, VMOD_DIRECTOR_HASH_MAGIC);
-	free(rr->hdr);
+	hash_src_free(rr);
 	FREE_OBJ(rr);
 }
 
+/*
+ * Jump consistent hash (Lamping & Veach), linear mode when all weights
+ * are equal: no table, O(ln n) and only 1/n of the keys move when a
+ * backend is added at the end. A key landing on a sick backend jumps
+ * again with a derived key, so the keys of healthy backends stay put.
+ */
+#define HASH_JUMP_TRIES		    32
+
+static unsigned
+hash_jump(uint64_t key, unsigned n)
+{
+	int64_t b = -1, j = 0;
+
+	while (j < n) {
+		b = j;
+		key = key * 2862933555777941757ULL + 1;
+		j = (b + 1) * ((double)(1LL << 31) / (double)((key >> 33) + 1));
+	}
+	return (b);
+}
+
+static int
+hash_jump_select(const struct hash_bound *hb, const struct udir_snapshot *snap,
+		 const struct udir_healthy *hs, uint32_t key)
+{
+	unsigned i, u, first = UDIR_MAX_BACKEND;
+	uint64_t k = key;
+
+	if (hs->n_backend == 0)
+		return (-1);
+	for (i = 0; i < HASH_JUMP_TRIES; i++) {
+		u = hash_jump(k, snap->n_backend);
+		if (first == UDIR_MAX_BACKEND && udir_healthy_test(hs, u))
+			first = u;
+		if (hash_bound_fits(hb, snap, hs, u))
+			return (u);
+		k = (uint64_t)fmix(key + i + 1) << 32 | key;
+	}
+	if (first != UDIR_MAX_BACKEND)
+		return (first);
+	/* mostly sick pool, spread over what is left */
+	return (hs->be_idx[key % hs->n_backend]);
+}
+
+/* snapshot index of the pick, -1 if none */
+static int
+hash_select(const struct vmod_director_hash *rr, const struct hash_bound *hb,
+	    const struct udir_snapshot *snap, const struct udir_healthy *hs,
+	    uint32_t key)
+{
+	unsigned i, j, u;
+
+	if (rr->algorithm == HASH_RING)
+		return (hash_ring_select(hb, snap, hs, key));
+	if (rr->algorithm == HASH_MAGLEV)
+		return (hash_maglev_select(hb, snap, hs, key));
+	if (rr->algorithm == HASH_RENDEZVOUS)
+		return (hash_hrw_select(hb, snap, hs, key));
+	if (snap->uniform)
+		return (hash_jump_select(hb, snap, hs, key));
+	if (hs->tw <= 0.0)
+		return (-1);
+	i = udir_healthy_pick(hs, scalbn(key, -32) * hs->tw);
+	for (j = 0; j < hs->n_backend; j++) {
+		u = hs->be_idx[(i + j) % hs->n_backend];
+		if (hash_bound_fits(hb, snap, hs, u))
+			return (u);
+	}
+	u = hs->be_idx[i];
+	assert(u < snap->n_backend);
+	return (u);
+}
+
+static uint32_t
+hash_key(const struct vmod_director_hash *rr, const char *p, size_t l)
+{
+	uint64_t h;
+
+	switch (rr->function) {
+	case HASH_FN_XXH3:
+		h = hash_xxh3_64(p, l);
+		break;
+	case HASH_FN_WYHASH:
+		h = hash_wyhash_64(p, l);
+		break;
+	default:
+		return (MurmurHash3_32(p, l, 0));
+	}
+	return ((uint32_t)(h ^ (h >> 32)));
+}
+
 static VCL_BACKEND v_matchproto_(vdi_resolve_f)
 hash_vdi_resolve(VRT_CTX, VCL_BACKEND dir)
 {
         struct vmod_unidirectors_director *vd;
+	const struct udir_snapshot *snap;
+	const struct udir_healthy *hs;
 	struct vmod_director_hash *rr;
+	struct hash_bound hb[1];
 	const char *p;
-	VCL_BACKEND be, rbe = NULL;
-	be_idx_t *be_idx;
-	unsigned u, h, n_backend = 0;
-	double r, a, tw = 0.0;
+	size_t l;
+	VCL_BACKEND rbe = NULL;
+	uint32_t key = 0;
+	unsigned i, n = 0;
+	int u;
 
 	CHECK_OBJ_NOTNULL(ctx, VRT_CTX_MAGIC);
 	CHECK_OBJ_NOTNULL(ctx->bo, BUSYOBJ_MAGIC);
@@ -135,42 +818,147 @@ hash_vdi_resolve(VRT_CTX, VCL_BACKEND dir)
 	CAST_OBJ_NOTNULL(vd, dir->priv, VMOD_UNIDIRECTORS_DIRECTOR_MAGIC);
 	AN(ctx->bo->bereq);
 
-	udir_rdlock(vd);
+	snap = udir_enter(vd);
 	CAST_OBJ_NOTNULL(rr, vd->priv, VMOD_DIRECTOR_HASH_MAGIC);
-	if (!rr->hdr || !http_GetHdr(ctx->bo->bereq, rr->hdr, &p)) {
+	/* each source found is hashed in place and mixed into the key */
+	for (i = 0; i < rr->n_src; i++) {
+		if (!hash_src_get(ctx, &rr->src[i], &p, &l))
+			continue;
+		key = n++ == 0 ? hash_key(rr, p, l) :
+		    fmix(key ^ (hash_key(rr, p, l) + 0x9e3779b9 +
+		    (key << 6) + (key >> 2)));
+	}
+	if (n == 0) {
 		AN(ctx->http_bereq);
 		p = ctx->http_bereq->hd[HTTP_HDR_URL].b;
+		l = Tlen(ctx->http_bereq->hd[HTTP_HDR_URL]);
+		key = hash_key(rr, p, l);
 	}
-	r = MurmurHash3_32(p, strlen(p), 0);
-	r = scalbn(r, -32);
-	if (WS_Reserve(ctx->ws, 0) >= vd->n_backend * sizeof(*be_idx)) {
-		be_idx = (void*)ctx->ws->f;
-		for (u = 0; u < vd->n_backend; u++) {
-			be = vd->backend[u];
-			CHECK_OBJ_NOTNULL(be, DIRECTOR_MAGIC);
-			if (VRT_Healthy(ctx, be, NULL)) {
-				be_idx[n_backend++] = u;
-				tw += vd->weight[u];
-			}
+	hs = udir_healthy_get(ctx, vd, snap);
+	hash_bound_init(hb, rr, vd, hs);
+	u = hash_select(rr, hb, snap, hs, key);
+	if (u >= 0 && !VRT_Healthy(ctx, snap->backend[u], NULL)) {
+		hs = udir_healthy_update(ctx, vd, snap, hs);
+		hash_bound_init(hb, rr, vd, hs);
+		u = hash_select(rr, hb, snap, hs, key);
+	}
+	if (u >= 0) {
+		assert(u < (int)snap->n_backend);
+		rbe = snap->backend[u];
+		/* bounded loads count what they route */
+		if (rr->max_load_factor > 0.0)
+			udir_task_track(ctx, vd, snap->stat[u], 0.0,
+			    &vd->inflight);
+	}
+	udir_leave(vd);
+	return (rbe);
+}
+
+/*
+ * With -p, the share of the keys going to each backend is shown next to
+ * its weight. It is sampled on HASH_SHARE_KEYS keys evenly spread over
+ * the hash space, with the current healthy set and without bounds.
+ */
+#define HASH_SHARE_KEYS		    4096
+
+static void v_matchproto_(vdi_list_f)
+hash_vdi_list(VRT_CTX, VCL_BACKEND dir, struct vsb *vsb, int pflag, int jflag)
+{
+	struct vmod_unidirectors_director *vd;
+	const struct udir_snapshot *snap;
+	const struct udir_healthy *hs;
+	struct vmod_director_hash *rr;
+	struct hash_bound hb[1] = {{ 0.0 }};
+	VCL_BACKEND be;
+	unsigned u, n, nh, h, *cnt = NULL;
+	double w;
+	int i, s;
+
+	CHECK_OBJ_NOTNULL(ctx, VRT_CTX_MAGIC);
+	CHECK_OBJ_NOTNULL(dir, DIRECTOR_MAGIC);
+	CAST_OBJ_NOTNULL(vd, dir->priv, VMOD_UNIDIRECTORS_DIRECTOR_MAGIC);
+
+	snap = udir_enter(vd);
+	CAST_OBJ_NOTNULL(rr, vd->priv, VMOD_DIRECTOR_HASH_MAGIC);
+	hs = udir_healthy_get(ctx, vd, snap);
+	for (u = 0; u < snap->n_backend; u++)
+		if (!VRT_Healthy(ctx, snap->backend[u], NULL) !=
+		    !udir_healthy_test(hs, u))
+			break;
+	if (u < snap->n_backend)
+		hs = udir_healthy_update(ctx, vd, snap, hs);
+	n = snap->n_backend;
+	nh = hs->n_backend;
+	if (pflag) {
+		cnt = calloc(n + 1, sizeof *cnt);
+		AN(cnt);
+		for (i = 0; i < HASH_SHARE_KEYS; i++) {
+			s = hash_select(rr, hb, snap, hs,
+			    ((uint64_t)i << 32) / HASH_SHARE_KEYS);
+			if (s >= 0)
+				cnt[s]++;
 		}
-	} else
-		VRT_fail(ctx, "%s: Workspace overflow on vdi_resolve", vd->vcl_name);
-	if (tw > 0.0) {
-		r *= tw;
-		a = 0.0;
-		for (h = 0; h < n_backend; h++) {
-			u = be_idx[h];
-			assert(u < vd->n_backend);
-			a += vd->weight[u];
-			if (r < a) {
-				rbe = vd->backend[u];
-				break;
-			}
+		if (jflag) {
+			VSB_cat(vsb, "{\n");
+			VSB_indent(vsb, 2);
+			VSB_printf(vsb, "\"total_weight\": %f,\n", hs->tw);
+			VSB_cat(vsb, "\"backends\": {\n");
+			VSB_indent(vsb, 2);
+		} else {
+			VSB_cat(vsb, "\n\n\tBackend\tWeight\tHealth\tShare\n");
 		}
 	}
-	WS_Release(ctx->ws, 0);
-	udir_unlock(vd);
-	return (rbe);
+	for (u = 0; pflag && u < n; u++) {
+		be = snap->backend[u];
+		CHECK_OBJ_NOTNULL(be, DIRECTOR_MAGIC);
+		AN(cnt);
+		h = udir_healthy_test(hs, u) ? 1 : 0;
+		w = h ? snap->weight[u] : 0.0;
+
+		if (jflag) {
+			if (u)
+				VSB_cat(vsb, ",\n");
+			VSB_printf(vsb, "\"%s\": {\n", be->vcl_name);
+			VSB_indent(vsb, 2);
+			VSB_printf(vsb, "\"weight\": %f,\n", w);
+			VSB_printf(vsb, "\"share\": %f,\n",
+			    (double)cnt[u] / HASH_SHARE_KEYS);
+			if (h)
+				VSB_cat(vsb, "\"health\": \"healthy\"\n");
+			else
+				VSB_cat(vsb, "\"health\": \"sick\"\n");
+
+			VSB_indent(vsb, -2);
+			VSB_cat(vsb, "}");
+		} else {
+			VSB_cat(vsb, "\t");
+			VSB_cat(vsb, be->vcl_name);
+			VSB_printf(vsb, "\t%6.2f%%\t",
+			    hs->tw > 0.0 ? 100 * w / hs->tw : 0.0);
+			VSB_cat(vsb, h ? "healthy" : "sick");
+			VSB_printf(vsb, "\t%6.2f%%\n",
+			    100.0 * cnt[u] / HASH_SHARE_KEYS);
+		}
+	}
+	udir_leave(vd);
+	free(cnt);
+
+	if (jflag && (pflag)) {
+		VSB_cat(vsb, "\n");
+		VSB_indent(vsb, -2);
+		VSB_cat(vsb, "}\n");
+		VSB_indent(vsb, -2);
+		VSB_cat(vsb, "},\n");
+	}
+
+	if (pflag)
+		return;
+
+	if (jflag)
+		VSB_printf(vsb, "[%u, %u, \"%s\"]", nh, n,
+		    nh ? "healthy" : "sick");
+	else
+		VSB_printf(vsb, "%u/%u\t%s", nh, n, nh ? "healthy" : "sick");
 }
 
 static const struct vdi_methods hash_methods[1] = {{
@@ -178,14 +966,20 @@ static const struct vdi_methods hash_methods[1] = {{
 	.type =			"hash",
 	.healthy =		udir_vdi_healthy,
 	.resolve =		hash_vdi_resolve,
+#ifdef HAVE_STRUCT_VDI_METHODS_FIND
 	.find =			udir_vdi_find,
+#endif
+#ifdef HAVE_STRUCT_VDI_METHODS_UPTIME
 	.uptime =		udir_vdi_uptime,
+#endif
 	.destroy =		hash_vdi_destroy,
-	.list =                 udir_vdi_list,
+	.list =                 hash_vdi_list,
 }};
 
 VCL_VOID v_matchproto_()
-vmod_director_hash(VRT_CTX, struct vmod_unidirectors_director *vd, VCL_STRING hdr)
+vmod_director_hash(VRT_CTX, struct vmod_unidirectors_director *vd, VCL_STRING hdr,
+		   VCL_ENUM algorithm, VCL_INT vnodes, VCL_INT fanout,
+		   VCL_REAL max_load_factor, VCL_ENUM function, VCL_STRING key)
 {
         unsigned l;
         struct vmod_director_hash *rr;
@@ -204,18 +998,62 @@ vmod_director_hash(VRT_CTX, struct vmod_unidirectors_director *vd, VCL_STRING hd
 	AN(vd->priv);
 
 	AN(hdr);
+	AN(key);
 	l = strlen(hdr);
-	if (l > 1) {
-	        unsigned u;
-		char *p;
-		rr->hdr = calloc(l+2, 1);
-		AN(rr->hdr);
-		p = rr->hdr;
-		*p++ = l+1;
-		for (u=0; u<l; u++)
-		        *p++ = hdr[u];
-		*p++ = ':';
+	if (l > 1 && *key != '\0')
+		VRT_fail(ctx, "%s: hdr and key are exclusive", vd->vcl_name);
+	else if (l >= 254)
+		VRT_fail(ctx, "%s: hdr too long", vd->vcl_name);
+	else if (l > 1) {
+		rr->src = calloc(1, sizeof *rr->src);
+		AN(rr->src);
+		rr->n_src = 1;
+		rr->src->type = HASH_SRC_HDR;
+		rr->src->hdr = hash_hdr_new(hdr, l);
+	} else
+		(void)hash_src_parse(ctx, vd, rr, key);
+
+	if (max_load_factor != 0.0 && max_load_factor < 1.0) {
+		VRT_fail(ctx, "%s: max_load_factor must be 0 or at least 1",
+			 vd->vcl_name);
+		max_load_factor = 0.0;
+	}
+	rr->max_load_factor = max_load_factor;
+	if (!strcmp(function, "xxh3"))
+		rr->function = HASH_FN_XXH3;
+	else if (!strcmp(function, "wyhash"))
+		rr->function = HASH_FN_WYHASH;
+
+	if (!strcmp(algorithm, "ring")) {
+		if (vnodes < 1 || vnodes > 4096) {
+			VRT_fail(ctx, "%s: vnodes must be in 1..4096",
+				 vd->vcl_name);
+			vnodes = 160;
+		}
+		rr->algorithm = HASH_RING;
+		rr->vnodes = vnodes;
+		vd->snapshot_build = hash_ring_build;
+		vd->snapshot_free = hash_ring_free;
+	} else if (!strcmp(algorithm, "maglev")) {
+		rr->algorithm = HASH_MAGLEV;
+		vd->snapshot_build = hash_maglev_build;
+		vd->snapshot_free = hash_maglev_free;
+	} else if (!strcmp(algorithm, "rendezvous")) {
+		if (fanout < 0 || fanout == 1) {
+			VRT_fail(ctx, "%s: fanout must be 0 or more than 1",
+				 vd->vcl_name);
+			fanout = 0;
+		}
+		rr->algorithm = HASH_RENDEZVOUS;
+		rr->fanout = fanout;
+		vd->snapshot_build = hash_hrw_build;
+		vd->snapshot_free = hash_hrw_free;
+		vd->healthy_build = hash_hrw_healthy_build;
+		vd->healthy_free = free;
 	}
+	/* backends may already be there */
+	if (vd->snapshot_build != NULL)
+		vd->dirty = 1;
 
 	vd->dir = VRT_AddDirector(ctx, hash_methods, vd, "%s", vd->vcl_name);
 
@@ -223,9 +1061,12 @@ vmod_director_hash(VRT_CTX, struct vmod_unidirectors_director *vd, VCL_STRING hd
 }
 
 VCL_VOID v_matchproto_()
-vmod_dyndirector_hash(VRT_CTX, struct vmod_unidirectors_dyndirector *dyn, VCL_STRING hdr)
+vmod_dyndirector_hash(VRT_CTX, struct vmod_unidirectors_dyndirector *dyn, VCL_STRING hdr,
+		      VCL_ENUM algorithm, VCL_INT vnodes, VCL_INT fanout,
+		      VCL_REAL max_load_factor, VCL_ENUM function, VCL_STRING key)
 {
 	CHECK_OBJ_NOTNULL(ctx, VRT_CTX_MAGIC);
 	CHECK_OBJ_NOTNULL(dyn, VMOD_UNIDIRECTORS_DYNDIRECTOR_MAGIC);
-	vmod_director_hash(ctx, dyn->vd, hdr);
+	vmod_director_hash(ctx, dyn->vd, hdr, algorithm, vnodes, fanout,
+	    max_load_factor, function, key);
 }
@@ -0,0 +1,90 @@
+/*-
+ * Copyright (c) 2019 GANDI SAS
+ * All rights reserved.
+ *
+ * Author: Emmanuel Hocdet <manu@gandi.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Microbenchmark of the hash director key functions
+ *
+ * make hash_bench && ./hash_bench [iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "hash_fn.h"
+
+static const char *bench_keys[] = {
+	"192.168.100.42",
+	"/static/css/site.min.css",
+	"/api/v2/users/4242/orders?page=3&sort=date",
+	"/images/catalog/2019/summer/products/large/"
+	    "shoe-running-blue-42.jpg?w=640&h=480&q=85",
+	"sessionid=5f2b1c9e8a7d4e3f9b0a1c2d3e4f5a6b; csrftoken=Zq8xR2pL"
+	    "9vN4mK7jH3gF6dS1aW5eT0yU; _ga=GA1.2.1234567890.1561234567; "
+	    "lang=fr-FR; theme=dark; consent=analytics,ads",
+};
+
+static double
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + 1e-9 * ts.tv_nsec);
+}
+
+int
+main(int argc, char **argv)
+{
+	volatile uint64_t sink = 0;
+	unsigned long n = 10000000, i;
+	size_t k, l;
+	double t0, t1, t2, t3;
+
+	if (argc > 1)
+		n = strtoul(argv[1], NULL, 0);
+	printf("%6s %10s %10s %10s  (ns/key)\n", "len", "murmur3", "xxh3",
+	    "wyhash");
+	for (k = 0; k < sizeof bench_keys / sizeof *bench_keys; k++) {
+		l = strlen(bench_keys[k]);
+		t0 = bench_now();
+		/* strlen included, as done for murmur3 before */
+		for (i = 0; i < n; i++)
+			sink += MurmurHash3_32(bench_keys[k],
+			    strlen(bench_keys[k]), i);
+		t1 = bench_now();
+		for (i = 0; i < n; i++)
+			sink += hash_xxh3_64(bench_keys[k], l - (i & 1));
+		t2 = bench_now();
+		for (i = 0; i < n; i++)
+			sink += hash_wyhash_64(bench_keys[k], l - (i & 1));
+		t3 = bench_now();
+		printf("%6zu %10.2f %10.2f %10.2f\n", l,
+		    (t1 - t0) * 1e9 / n, (t2 - t1) * 1e9 / n,
+		    (t3 - t2) * 1e9 / n);
+	}
+	return (sink == 42);
+}
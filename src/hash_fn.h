@@ -0,0 +1,407 @@
+/*-
+ * Copyright (c) 2019 GANDI SAS
+ * All rights reserved.
+ *
+ * Author: Emmanuel Hocdet <manu@gandi.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Key hash functions of the hash director
+ *
+ * MurmurHash3_32 is the historic one and reads 32 bits blocks in network
+ * order, kept as is so keys do not move. XXH3 (64 bits, seed 0, default
+ * secret) and wyhash (final4) read little endian words in one pass; on
+ * little endian hosts that is a plain load.
+ */
+
+#ifndef UNIDIRECTORS_HASH_FN_H
+#define UNIDIRECTORS_HASH_FN_H
+
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+/* MurmurHash3_32 */
+static inline uint32_t getblock(const uint32_t * p, int i) {
+	return ntohl(p[i]);
+}
+static inline uint32_t rotl32(uint32_t x, int8_t r) {
+	return (x << r) | (x >> (32 - r));
+}
+static inline uint32_t fmix(uint32_t h)
+{
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
+static inline uint32_t
+MurmurHash3_32(const void *key, int len, uint32_t seed)
+{
+	const uint8_t *data = (const uint8_t *)key;
+	const int nblocks = len / 4;
+
+	uint32_t h1 = seed;
+	uint32_t c1 = 0xcc9e2d51;
+	uint32_t c2 = 0x1b873593;
+
+	const uint32_t *blocks = (const uint32_t *)(data + nblocks*4);
+	for (int i = -nblocks; i; i++) {
+		uint32_t k1 = getblock(blocks, i);
+		k1 *= c1;
+		k1 = rotl32(k1, 15);
+		k1 *= c2;
+		h1 ^= k1;
+		h1 = rotl32(h1, 13);
+		h1 = h1 * 5 + 0xe6546b64;
+	}
+
+	const uint8_t *tail = (const uint8_t*)(data + nblocks*4);
+	uint32_t k1 = 0;
+	switch(len & 3) {
+	case 3: k1 ^= tail[2] << 16;
+	case 2: k1 ^= tail[1] << 8;
+	case 1: k1 ^= tail[0];
+		k1 *= c1;
+		k1 = rotl32(k1, 15);
+		k1 *= c2;
+		h1 ^= k1;
+	};
+
+	h1 ^= len;
+	h1 = fmix(h1);
+
+	return h1;
+}
+/* MurmurHash3_32 */
+
+static inline uint64_t
+hash_read64(const uint8_t *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof v);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap64(v);
+#endif
+	return (v);
+}
+
+static inline uint32_t
+hash_read32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof v);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap32(v);
+#endif
+	return (v);
+}
+
+static inline uint64_t
+hash_mul128_fold64(uint64_t a, uint64_t b)
+{
+	__uint128_t r = (__uint128_t)a * b;
+
+	return ((uint64_t)r ^ (uint64_t)(r >> 64));
+}
+
+/* XXH3_64bits */
+#define XXH_PRIME32_1	0x9E3779B1U
+#define XXH_PRIME32_2	0x85EBCA77U
+#define XXH_PRIME32_3	0xC2B2AE3DU
+#define XXH_PRIME64_1	0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2	0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3	0x165667B19E3779F9ULL
+#define XXH_PRIME64_4	0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5	0x27D4EB2F165667C5ULL
+#define XXH_SECRET_SIZE	192
+#define XXH_STRIPE_LEN	64
+
+static const uint8_t xxh3_secret[XXH_SECRET_SIZE] = {
+	0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe,
+	0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+	0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb,
+	0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+	0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78,
+	0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+	0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e,
+	0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+	0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb,
+	0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+	0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e,
+	0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+	0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f,
+	0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+	0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31,
+	0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+	0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3,
+	0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+	0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49,
+	0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+	0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc,
+	0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+	0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28,
+	0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+static inline uint64_t
+xxh64_avalanche(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= XXH_PRIME64_2;
+	h ^= h >> 29;
+	h *= XXH_PRIME64_3;
+	h ^= h >> 32;
+	return (h);
+}
+
+static inline uint64_t
+xxh3_avalanche(uint64_t h)
+{
+	h ^= h >> 37;
+	h *= 0x165667919E3779F9ULL;
+	h ^= h >> 32;
+	return (h);
+}
+
+static inline uint64_t
+xxh3_rrmxmx(uint64_t h, uint64_t len)
+{
+	h ^= ((h << 49) | (h >> 15)) ^ ((h << 24) | (h >> 40));
+	h *= 0x9FB21C651E98DF25ULL;
+	h ^= (h >> 35) + len;
+	h *= 0x9FB21C651E98DF25ULL;
+	return (h ^ (h >> 28));
+}
+
+static inline uint64_t
+xxh3_mix16(const uint8_t *p, const uint8_t *s)
+{
+	return (hash_mul128_fold64(hash_read64(p) ^ hash_read64(s),
+	    hash_read64(p + 8) ^ hash_read64(s + 8)));
+}
+
+/* written as plain lanes, compilers turn it into SIMD where available */
+static inline void
+xxh3_accumulate_512(uint64_t *acc, const uint8_t *p, const uint8_t *s)
+{
+	uint64_t v, k;
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		v = hash_read64(p + 8 * i);
+		k = v ^ hash_read64(s + 8 * i);
+		acc[i ^ 1] += v;
+		acc[i] += (k & 0xffffffff) * (k >> 32);
+	}
+}
+
+static inline void
+xxh3_scramble(uint64_t *acc, const uint8_t *s)
+{
+	uint64_t a;
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		a = acc[i];
+		a ^= a >> 47;
+		a ^= hash_read64(s + 8 * i);
+		acc[i] = a * XXH_PRIME32_1;
+	}
+}
+
+static inline uint64_t
+xxh3_long(const uint8_t *p, size_t len)
+{
+	uint64_t acc[8] = {
+		XXH_PRIME32_3, XXH_PRIME64_1, XXH_PRIME64_2, XXH_PRIME64_3,
+		XXH_PRIME64_4, XXH_PRIME32_2, XXH_PRIME64_5, XXH_PRIME32_1
+	};
+	const size_t n_stripes = (XXH_SECRET_SIZE - XXH_STRIPE_LEN) / 8;
+	const size_t block_len = XXH_STRIPE_LEN * n_stripes;
+	const size_t n_blocks = (len - 1) / block_len;
+	const uint8_t *s = xxh3_secret;
+	uint64_t r;
+	size_t b, n, last;
+	int i;
+
+	for (b = 0; b < n_blocks; b++) {
+		for (n = 0; n < n_stripes; n++)
+			xxh3_accumulate_512(acc,
+			    p + b * block_len + n * XXH_STRIPE_LEN, s + n * 8);
+		xxh3_scramble(acc, s + XXH_SECRET_SIZE - XXH_STRIPE_LEN);
+	}
+	last = ((len - 1) - block_len * n_blocks) / XXH_STRIPE_LEN;
+	for (n = 0; n < last; n++)
+		xxh3_accumulate_512(acc,
+		    p + n_blocks * block_len + n * XXH_STRIPE_LEN, s + n * 8);
+	xxh3_accumulate_512(acc, p + len - XXH_STRIPE_LEN,
+	    s + XXH_SECRET_SIZE - XXH_STRIPE_LEN - 7);
+
+	r = len * XXH_PRIME64_1;
+	for (i = 0; i < 4; i++)
+		r += hash_mul128_fold64(acc[2 * i] ^ hash_read64(s + 11 + 16 * i),
+		    acc[2 * i + 1] ^ hash_read64(s + 11 + 16 * i + 8));
+	return (xxh3_avalanche(r));
+}
+
+static inline uint64_t
+hash_xxh3_64(const void *key, size_t len)
+{
+	const uint8_t *p = key, *s = xxh3_secret;
+	uint64_t acc, lo, hi;
+	uint32_t c;
+	size_t i;
+
+	if (len == 0)
+		return (xxh64_avalanche(hash_read64(s + 56) ^
+		    hash_read64(s + 64)));
+	if (len <= 3) {
+		c = ((uint32_t)p[0] << 16) | ((uint32_t)p[len >> 1] << 24) |
+		    p[len - 1] | ((uint32_t)len << 8);
+		return (xxh64_avalanche(c ^
+		    (uint64_t)(hash_read32(s) ^ hash_read32(s + 4))));
+	}
+	if (len <= 8) {
+		lo = hash_read32(p + len - 4) +
+		    ((uint64_t)hash_read32(p) << 32);
+		return (xxh3_rrmxmx(lo ^
+		    (hash_read64(s + 8) ^ hash_read64(s + 16)), len));
+	}
+	if (len <= 16) {
+		lo = hash_read64(p) ^ (hash_read64(s + 24) ^ hash_read64(s + 32));
+		hi = hash_read64(p + len - 8) ^
+		    (hash_read64(s + 40) ^ hash_read64(s + 48));
+		acc = len + __builtin_bswap64(lo) + hi +
+		    hash_mul128_fold64(lo, hi);
+		return (xxh3_avalanche(acc));
+	}
+	acc = len * XXH_PRIME64_1;
+	if (len <= 128) {
+		if (len > 32) {
+			if (len > 64) {
+				if (len > 96) {
+					acc += xxh3_mix16(p + 48, s + 96);
+					acc += xxh3_mix16(p + len - 64, s + 112);
+				}
+				acc += xxh3_mix16(p + 32, s + 64);
+				acc += xxh3_mix16(p + len - 48, s + 80);
+			}
+			acc += xxh3_mix16(p + 16, s + 32);
+			acc += xxh3_mix16(p + len - 32, s + 48);
+		}
+		acc += xxh3_mix16(p, s);
+		acc += xxh3_mix16(p + len - 16, s + 16);
+		return (xxh3_avalanche(acc));
+	}
+	if (len <= 240) {
+		for (i = 0; i < 8; i++)
+			acc += xxh3_mix16(p + 16 * i, s + 16 * i);
+		acc = xxh3_avalanche(acc);
+		for (i = 8; i < len / 16; i++)
+			acc += xxh3_mix16(p + 16 * i, s + 16 * (i - 8) + 3);
+		acc += xxh3_mix16(p + len - 16, s + 136 - 17);
+		return (xxh3_avalanche(acc));
+	}
+	return (xxh3_long(p, len));
+}
+
+/* wyhash final4, seed 0 and default secret */
+static const uint64_t wyhash_secret[4] = {
+	0x2d358dccaa6c78a5ULL, 0x8bb84b93962eacc9ULL,
+	0x4b33a62ed433d4a3ULL, 0x4d5a2da51de1aa47ULL
+};
+
+static inline void
+wyhash_mum(uint64_t *a, uint64_t *b)
+{
+	__uint128_t r = (__uint128_t)*a * *b;
+
+	*a = (uint64_t)r;
+	*b = (uint64_t)(r >> 64);
+}
+
+static inline uint64_t
+wyhash_mix(uint64_t a, uint64_t b)
+{
+	wyhash_mum(&a, &b);
+	return (a ^ b);
+}
+
+static inline uint64_t
+hash_wyhash_64(const void *key, size_t len)
+{
+	const uint8_t *p = key;
+	const uint64_t *s = wyhash_secret;
+	uint64_t seed, see1, see2, a, b;
+	size_t i;
+
+	seed = wyhash_mix(s[0], s[1]);
+	if (len <= 16) {
+		if (len >= 4) {
+			a = ((uint64_t)hash_read32(p) << 32) |
+			    hash_read32(p + ((len >> 3) << 2));
+			b = ((uint64_t)hash_read32(p + len - 4) << 32) |
+			    hash_read32(p + len - 4 - ((len >> 3) << 2));
+		} else if (len > 0) {
+			a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) |
+			    p[len - 1];
+			b = 0;
+		} else
+			a = b = 0;
+	} else {
+		i = len;
+		if (i > 48) {
+			see1 = see2 = seed;
+			do {
+				seed = wyhash_mix(hash_read64(p) ^ s[1],
+				    hash_read64(p + 8) ^ seed);
+				see1 = wyhash_mix(hash_read64(p + 16) ^ s[2],
+				    hash_read64(p + 24) ^ see1);
+				see2 = wyhash_mix(hash_read64(p + 32) ^ s[3],
+				    hash_read64(p + 40) ^ see2);
+				p += 48;
+				i -= 48;
+			} while (i > 48);
+			seed ^= see1 ^ see2;
+		}
+		while (i > 16) {
+			seed = wyhash_mix(hash_read64(p) ^ s[1],
+			    hash_read64(p + 8) ^ seed);
+			i -= 16;
+			p += 16;
+		}
+		a = hash_read64(p + i - 16);
+		b = hash_read64(p + i - 8);
+	}
+	a ^= s[1];
+	b ^= seed;
+	wyhash_mum(&a, &b);
+	return (wyhash_mix(a ^ s[0] ^ len, b ^ s[1]));
+}
+
+#endif
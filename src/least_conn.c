@@ -28,6 +28,7 @@
 
 #include "config.h"
 
+#include <float.h>
 #include <stdlib.h>
 #include <math.h>
 #include <string.h>
@@ -40,10 +41,35 @@
 #include "udir.h"
 #include "dynamic.h"
 
+/*
+ * Weighted loads are kept in a tournament tree: each inner node holds the
+ * leaf with the least load of its two children, the root the least
+ * loaded backend. The loads are the fetches in flight counted by the
+ * director, refreshed by one thread at most every LC_TICK seconds into a
+ * new tree published under epoch; in between a pick adds one fetch to
+ * its backend and replays its path, O(log n) and without a lock.
+ */
+#define LC_TICK		0.01
+
+struct lc_tree {
+	unsigned				magic;
+#define LC_TREE_MAGIC				0x3d0b7e62
+	unsigned				gen;
+	unsigned				n;
+	unsigned				n_leaf;	/* power of 2 */
+	double					t_refresh;
+	double					*load;	/* [n_leaf] */
+	double					*inc;	/* [n_leaf] */
+	unsigned				*win;	/* [n_leaf], 1 is root */
+};
+
 struct vmod_director_leastconn {
 	unsigned				magic;
 #define VMOD_DIRECTOR_LEASTCONN_MAGIC           0xadda6fc5
 	unsigned				slow_start;
+
+	pthread_mutex_t				rmtx;	/* refresh */
+	struct lc_tree				*tree;
 };
 
 static void v_matchproto_(vdi_destroy_f)
@@ -54,43 +80,172 @@ lc_vdi_destroy(VCL_BACKEND dir)
 	CHECK_OBJ_NOTNULL(dir, DIRECTOR_MAGIC);
 	CAST_OBJ_NOTNULL(vd, dir->priv, VMOD_UNIDIRECTORS_DIRECTOR_MAGIC);
 	CAST_OBJ_NOTNULL(lc, vd->priv, VMOD_DIRECTOR_LEASTCONN_MAGIC);
+	AZ(pthread_mutex_destroy(&lc->rmtx));
+	free(lc->tree);
 	FREE_OBJ(lc);
 }
 
+static inline double
+lc_load(const struct lc_tree *t, unsigned leaf)
+{
+	double load;
+
+	__atomic_load(&t->load[leaf], &load, __ATOMIC_RELAXED);
+	return (load);
+}
+
+/* least loaded of two leaves, the last one on a tie */
+static inline unsigned
+lc_match(const struct lc_tree *t, unsigned a, unsigned b)
+{
+	return (lc_load(t, b) <= lc_load(t, a) ? b : a);
+}
+
+/* winner of a node, a leaf below n_leaf */
+static inline unsigned
+lc_win(const struct lc_tree *t, unsigned i)
+{
+	if (i >= t->n_leaf)
+		return (i - t->n_leaf);
+	return (__atomic_load_n(&t->win[i], __ATOMIC_RELAXED));
+}
+
+/*
+ * Racing picks may leave a node with a stale winner, fixed by the next
+ * replay through it or by the next refresh, LC_TICK at most.
+ */
+static void
+lc_charge(struct lc_tree *t, unsigned leaf)
+{
+	double o, n;
+	unsigned i;
+
+	__atomic_load(&t->load[leaf], &o, __ATOMIC_RELAXED);
+	do
+		n = o + t->inc[leaf];
+	while (!__atomic_compare_exchange(&t->load[leaf], &o, &n, 1,
+	    __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	for (i = (t->n_leaf + leaf) / 2; i > 0; i /= 2)
+		__atomic_store_n(&t->win[i],
+		    lc_match(t, lc_win(t, 2 * i), lc_win(t, 2 * i + 1)),
+		    __ATOMIC_RELAXED);
+}
+
+/* loads of all backends in a new tree, rmtx held */
+static struct lc_tree *
+lc_refresh(VRT_CTX, struct vmod_director_leastconn *lc,
+	   const struct udir_snapshot *snap, double now)
+{
+	struct lc_tree *t;
+	unsigned u, n_leaf;
+	double changed, delta_t, load;
+	VCL_BACKEND be;
+
+	for (n_leaf = 1; n_leaf < snap->n_backend; n_leaf *= 2)
+		continue;
+	t = malloc(sizeof *t + n_leaf * (sizeof *t->load + sizeof *t->inc +
+	    sizeof *t->win));
+	AN(t);
+	INIT_OBJ(t, LC_TREE_MAGIC);
+	t->load = (void *)(t + 1);
+	t->inc = t->load + n_leaf;
+	t->win = (void *)(t->inc + n_leaf);
+	t->gen = snap->gen;
+	t->n = snap->n_backend;
+	t->n_leaf = n_leaf;
+	t->t_refresh = now;
+	for (u = 0; u < n_leaf; u++) {
+		t->load[u] = INFINITY;
+		t->inc[u] = 0.0;
+	}
+	for (u = 0; u < snap->n_backend; u++) {
+		be = snap->backend[u];
+		CHECK_OBJ_NOTNULL(be, DIRECTOR_MAGIC);
+		if (!VRT_Healthy(ctx, be, &changed))
+			continue;
+		CHECK_OBJ_NOTNULL(snap->stat[u], UDIR_STAT_MAGIC);
+		load = __atomic_load_n(&snap->stat[u]->inflight,
+		    __ATOMIC_RELAXED);
+		delta_t = now - changed;
+		if (delta_t < 0)
+			delta_t = 0.0;
+		load = load / snap->weight[u];
+		if (delta_t < lc->slow_start)
+			load = load / delta_t * lc->slow_start;
+		/* up but without weight: only when nothing else is */
+		t->load[u] = isinf(load) || isnan(load) ? DBL_MAX : load;
+		t->inc[u] = snap->weight[u] > 0.0 ? 1.0 / snap->weight[u] : 0.0;
+		if (delta_t < lc->slow_start && delta_t > 0.0)
+			t->inc[u] *= lc->slow_start / delta_t;
+	}
+	for (u = n_leaf - 1; u > 0; u--)
+		t->win[u] = lc_match(t, lc_win(t, 2 * u), lc_win(t, 2 * u + 1));
+
+	udir_epoch_retire(__atomic_exchange_n(&lc->tree, t, __ATOMIC_ACQ_REL),
+	    free);
+	return (t);
+}
+
+/* snapshot index of the least loaded healthy backend, -1 if none */
+static int
+lc_select(const struct lc_tree *t, const struct udir_snapshot *snap)
+{
+	unsigned u;
+
+	if (t->gen != snap->gen || t->n == 0)
+		return (-1);
+	u = t->n_leaf > 1 ? lc_win(t, 1) : 0;
+	if (u >= snap->n_backend || isinf(lc_load(t, u)))
+		return (-1);
+	return (u);
+}
+
 static VCL_BACKEND v_matchproto_(vdi_resolve_f)
 lc_vdi_resolve(VRT_CTX, VCL_BACKEND dir)
 {
 	struct vmod_unidirectors_director *vd;
+	const struct udir_snapshot *snap;
 	struct vmod_director_leastconn *lc;
-	unsigned u;
-	double changed, now, delta_t, load, least = INFINITY;
-	VCL_BACKEND be, rbe = NULL;
+	struct lc_tree *t;
+	double now;
+	int u;
+	VCL_BACKEND rbe = NULL;
 
 	CHECK_OBJ_NOTNULL(ctx, VRT_CTX_MAGIC);
 	CHECK_OBJ_NOTNULL(dir, DIRECTOR_MAGIC);
 	CAST_OBJ_NOTNULL(vd, dir->priv, VMOD_UNIDIRECTORS_DIRECTOR_MAGIC);
 
-	udir_rdlock(vd);
+	snap = udir_enter(vd);
 	CAST_OBJ_NOTNULL(lc, vd->priv, VMOD_DIRECTOR_LEASTCONN_MAGIC);
-	now = VTIM_real();
-	for (u = 0; u < vd->n_backend; u++) {
-		be = vd->backend[u];
-		CHECK_OBJ_NOTNULL(be, DIRECTOR_MAGIC);
-		AN(be->vdir->methods->uptime);
-		if (be->vdir->methods->uptime(ctx, be, &changed, &load)) {
-			delta_t = now - changed;
-			if (delta_t < 0)
-				delta_t = 0.0;
-			load = load / vd->weight[u];
-			if (delta_t < lc->slow_start)
-				load = load / delta_t * lc->slow_start;
-			if (load <= least) {
-				rbe = be;
-				least = load;
-			}
-		}
+	now = ctx->now > 0. ? ctx->now : VTIM_real();
+	t = __atomic_load_n(&lc->tree, __ATOMIC_ACQUIRE);
+	if (t == NULL || t->gen != snap->gen) {
+		AZ(pthread_mutex_lock(&lc->rmtx));
+		t = __atomic_load_n(&lc->tree, __ATOMIC_ACQUIRE);
+		if (t == NULL || t->gen != snap->gen)
+			t = lc_refresh(ctx, lc, snap, now);
+		AZ(pthread_mutex_unlock(&lc->rmtx));
+	} else if (now - t->t_refresh > LC_TICK &&
+	    !pthread_mutex_trylock(&lc->rmtx)) {
+		t = lc_refresh(ctx, lc, snap, now);
+		AZ(pthread_mutex_unlock(&lc->rmtx));
 	}
-	udir_unlock(vd);
+	CHECK_OBJ_NOTNULL(t, LC_TREE_MAGIC);
+
+	u = lc_select(t, snap);
+	if (u >= 0 && !VRT_Healthy(ctx, snap->backend[u], NULL)) {
+		/* gone sick since the last refresh */
+		AZ(pthread_mutex_lock(&lc->rmtx));
+		t = lc_refresh(ctx, lc, snap, now);
+		AZ(pthread_mutex_unlock(&lc->rmtx));
+		u = lc_select(t, snap);
+	}
+	if (u >= 0) {
+		rbe = snap->backend[u];
+		lc_charge(t, u);
+		udir_task_track(ctx, vd, snap->stat[u], 0.0, NULL);
+	}
+	udir_leave(vd);
 	return (rbe);
 }
 
@@ -99,8 +254,12 @@ static const struct vdi_methods lc_methods[1] = {{
 	.type =			"least-connections",
 	.healthy =		udir_vdi_healthy,
 	.resolve =		lc_vdi_resolve,
+#ifdef HAVE_STRUCT_VDI_METHODS_FIND
 	.find =			udir_vdi_find,
+#endif
+#ifdef HAVE_STRUCT_VDI_METHODS_UPTIME
 	.uptime =		udir_vdi_uptime,
+#endif
 	.destroy =		lc_vdi_destroy,
 	.list =                 udir_vdi_list,
 }};
@@ -123,6 +282,7 @@ vmod_director_leastconn(VRT_CTX, struct vmod_unidirectors_director *vd, VCL_INT
 	vd->priv = lc;
 	AN(vd->priv);
 	lc->slow_start = slow_start;
+	AZ(pthread_mutex_init(&lc->rmtx, NULL));
 
 	vd->dir = VRT_AddDirector(ctx, lc_methods, vd, "%s", vd->vcl_name);
 
@@ -40,17 +40,117 @@
 #include "cache/cache.h"
 #include "cache/cache_director.h"
 
-#include "vrnd.h"
-
 #include "udir.h"
 #include "dynamic.h"
 
+#define RANDOM_MAX_CHOICES			16
+
 struct vmod_director_random {
 	unsigned				magic;
 #define VMOD_DIRECTOR_RANDOM_MAGIC              0x5b02c294
 	int				        choices;
 };
 
+/* Vose alias table over the healthy set, built with it */
+struct random_alias {
+	unsigned				magic;
+#define RANDOM_ALIAS_MAGIC			0x9d3e1f62
+	unsigned				n;
+	double					*prob;
+	be_idx_t				*alias;
+};
+
+static void
+random_alias_free(void *priv)
+{
+	struct random_alias *ra;
+
+	CAST_OBJ_NOTNULL(ra, priv, RANDOM_ALIAS_MAGIC);
+	FREE_OBJ(ra);
+}
+
+static void * v_matchproto_(udir_healthy_build_f)
+random_alias_build(const struct vmod_unidirectors_director *vd,
+		   const struct udir_snapshot *snap, const struct udir_healthy *hs)
+{
+	struct random_alias *ra;
+	be_idx_t *small, *large;
+	unsigned h, l, g, ns = 0, nl = 0, n;
+	double *p;
+
+	CHECK_OBJ_NOTNULL(vd, VMOD_UNIDIRECTORS_DIRECTOR_MAGIC);
+	CHECK_OBJ_NOTNULL(snap, UDIR_SNAPSHOT_MAGIC);
+	CHECK_OBJ_NOTNULL(hs, UDIR_HEALTHY_MAGIC);
+	n = hs->n_backend;
+	if (n == 0 || hs->tw <= 0.0)
+		return (NULL);
+
+	ra = calloc(1, sizeof *ra + n * (sizeof *ra->prob + sizeof *ra->alias));
+	AN(ra);
+	ra->magic = RANDOM_ALIAS_MAGIC;
+	ra->n = n;
+	ra->prob = (void *)(ra + 1);
+	ra->alias = (void *)(ra->prob + n);
+
+	p = malloc(n * sizeof *p);
+	AN(p);
+	small = malloc(2 * n * sizeof *small);
+	AN(small);
+	large = small + n;
+
+	for (h = 0; h < n; h++) {
+		p[h] = snap->weight[hs->be_idx[h]] * n / hs->tw;
+		if (p[h] < 1.0)
+			small[ns++] = h;
+		else
+			large[nl++] = h;
+	}
+	while (ns > 0 && nl > 0) {
+		l = small[--ns];
+		g = large[--nl];
+		ra->prob[l] = p[l];
+		ra->alias[l] = g;
+		p[g] = (p[g] + p[l]) - 1.0;
+		if (p[g] < 1.0)
+			small[ns++] = g;
+		else
+			large[nl++] = g;
+	}
+	/* leftovers are 1.0 up to rounding errors */
+	while (nl > 0) {
+		g = large[--nl];
+		ra->prob[g] = 1.0;
+		ra->alias[g] = g;
+	}
+	while (ns > 0) {
+		l = small[--ns];
+		ra->prob[l] = 1.0;
+		ra->alias[l] = l;
+	}
+	free(small);
+	free(p);
+	return (ra);
+}
+
+/* position in the healthy set of one weighted draw */
+static unsigned
+random_draw(const struct udir_healthy *hs)
+{
+	const struct random_alias *ra;
+	unsigned h;
+	double r;
+
+	r = udir_random();
+	if (hs->priv == NULL)
+		return (udir_healthy_pick(hs, r * hs->tw));
+	CAST_OBJ_NOTNULL(ra, hs->priv, RANDOM_ALIAS_MAGIC);
+	assert(ra->n == hs->n_backend);
+	h = r * ra->n;
+	if (udir_random() < ra->prob[h])
+		return (h);
+	return (ra->alias[h]);
+}
+
 static void v_matchproto_(vdi_destroy_f)
 random_vdi_destroy(VCL_BACKEND dir)
 {
@@ -62,72 +162,104 @@ random_vdi_destroy(VCL_BACKEND dir)
 	FREE_OBJ(rand);
 }
 
+static inline double
+random_weight(const struct udir_healthy *hs, unsigned h)
+{
+	return (hs->cw[h] - (h > 0 ? hs->cw[h - 1] : 0.0));
+}
+
+static inline double
+random_load(const struct udir_snapshot *snap, unsigned u)
+{
+	CHECK_OBJ_NOTNULL(snap->stat[u], UDIR_STAT_MAGIC);
+	return (__atomic_load_n(&snap->stat[u]->inflight, __ATOMIC_RELAXED) /
+	    snap->weight[u]);
+}
+
+/*
+ * Snapshot index of the pick, -1 if none. With choices, the least loaded
+ * of up to that many distinct backends drawn by weight without
+ * replacement: a draw is done over the weights left, stepping over the
+ * intervals of the backends already drawn.
+ */
+static int
+random_select(const struct udir_snapshot *snap,
+	      const struct udir_healthy *hs, int choices)
+{
+	unsigned pos[RANDOM_MAX_CHOICES];	/* drawn, increasing */
+	unsigned h, i, k;
+	int ru;
+	double r, lo, rest, load, rload;
+
+	if (hs->n_backend == 0 || hs->tw <= 0.0)
+		return (-1);
+	h = random_draw(hs);
+	ru = hs->be_idx[h];
+	assert(ru < snap->n_backend);
+	/* one backend or one choice */
+	if (hs->n_backend <= 1 || choices <= 1)
+		return (ru);
+	rload = random_load(snap, ru);
+	pos[0] = h;
+	rest = hs->tw - random_weight(hs, h);
+	for (k = 1; k < (unsigned)choices && k < hs->n_backend &&
+	    rest > 0.0; k++) {
+		r = udir_random() * rest;
+		for (i = 0; i < k; i++) {
+			lo = pos[i] > 0 ? hs->cw[pos[i] - 1] : 0.0;
+			if (r < lo)
+				break;
+			r += hs->cw[pos[i]] - lo;
+		}
+		h = udir_healthy_pick(hs, r < hs->tw ? r : hs->tw);
+		/* rounding errors */
+		for (i = 0; i < k && pos[i] < h; i++)
+			continue;
+		if (i < k && pos[i] == h)
+			break;
+		memmove(&pos[i + 1], &pos[i], (k - i) * sizeof *pos);
+		pos[i] = h;
+		rest -= random_weight(hs, h);
+
+		assert(hs->be_idx[h] < snap->n_backend);
+		load = random_load(snap, hs->be_idx[h]);
+		if (load < rload) {
+			ru = hs->be_idx[h];
+			rload = load;
+		}
+	}
+	return (ru);
+}
+
 static VCL_BACKEND v_matchproto_(vdi_resolve_f)
 random_vdi_resolve(VRT_CTX, VCL_BACKEND dir)
 {
 	struct vmod_unidirectors_director *vd;
+	const struct udir_snapshot *snap;
+	const struct udir_healthy *hs;
 	struct vmod_director_random *rand;
-	VCL_BACKEND be, rbe = NULL;
-	be_idx_t *be_idx;
-	unsigned u, h, n_backend = 0;
-	double r, a, tw = 0.0;
-	double load, rload = INFINITY;
-	int choices;
+	VCL_BACKEND rbe = NULL;
+	int u;
 
 	CHECK_OBJ_NOTNULL(ctx, VRT_CTX_MAGIC);
 	CHECK_OBJ_NOTNULL(dir, DIRECTOR_MAGIC);
 	CAST_OBJ_NOTNULL(vd, dir->priv, VMOD_UNIDIRECTORS_DIRECTOR_MAGIC);
 
-	udir_rdlock(vd);
+	snap = udir_enter(vd);
 	CAST_OBJ_NOTNULL(rand, vd->priv, VMOD_DIRECTOR_RANDOM_MAGIC);
-	choices = rand->choices;
-	if (WS_Reserve(ctx->ws, 0) >= vd->n_backend * sizeof(*be_idx)) {
-		be_idx = (void*)ctx->ws->f;
-		for (u = 0; u < vd->n_backend; u++) {
-			be = vd->backend[u];
-			CHECK_OBJ_NOTNULL(be, DIRECTOR_MAGIC);
-			if (VRT_Healthy(ctx, be, NULL)) {
-				be_idx[n_backend++] = u;
-				tw += vd->weight[u];
-			}
-		}
-	} else
-		VRT_fail(ctx, "%s: Workspace overflow on vdi_resolve", vd->vcl_name);
-	if (tw > 0.0)
-		do {
-			be = NULL;
-			r = scalbn(VRND_RandomTestable(), -31);
-			r *= tw;
-			a = 0.0;
-			for (h = 0; h < n_backend; h++) {
-				u = be_idx[h];
-				assert(u < vd->n_backend);
-				a += vd->weight[u];
-				if (r < a) {
-					be = vd->backend[u];
-					CHECK_OBJ_NOTNULL(be, DIRECTOR_MAGIC);
-					break;
-				}
-			}
-			AN(be);
-			/* one backend or one choice */
-			if (n_backend <= 1 || rand->choices <= 1) {
-				rbe = be;
-				break;
-			}
-			if (be != rbe) {
-				if (be->vdir->methods->uptime(ctx, be, NULL, &load)) {
-					load = load / vd->weight[u];
-					if (load < rload) {
-						rbe = be;
-						rload = load;
-					}
-				} else if (!rbe)
-					rbe = be;
-			}
-		} while (--choices > 0);
-	WS_Release(ctx->ws, 0);
-	udir_unlock(vd);
+	hs = udir_healthy_get(ctx, vd, snap);
+	u = random_select(snap, hs, rand->choices);
+	if (u >= 0 && !VRT_Healthy(ctx, snap->backend[u], NULL)) {
+		hs = udir_healthy_update(ctx, vd, snap, hs);
+		u = random_select(snap, hs, rand->choices);
+	}
+	if (u >= 0) {
+		rbe = snap->backend[u];
+		/* choices compare the fetches in flight */
+		if (rand->choices > 1)
+			udir_task_track(ctx, vd, snap->stat[u], 0.0, NULL);
+	}
+	udir_leave(vd);
 	return (rbe);
 }
 
@@ -136,14 +268,19 @@ static const struct vdi_methods random_methods[1] = {{
 	.type =			"random",
 	.healthy =		udir_vdi_healthy,
 	.resolve =		random_vdi_resolve,
+#ifdef HAVE_STRUCT_VDI_METHODS_FIND
 	.find =			udir_vdi_find,
+#endif
+#ifdef HAVE_STRUCT_VDI_METHODS_UPTIME
 	.uptime =		udir_vdi_uptime,
+#endif
 	.destroy =              random_vdi_destroy,
 	.list =                 udir_vdi_list,
 }};
 
 VCL_VOID v_matchproto_()
-vmod_director_random(VRT_CTX, struct vmod_unidirectors_director *vd, VCL_INT choices)
+vmod_director_random(VRT_CTX, struct vmod_unidirectors_director *vd, VCL_INT choices,
+		     VCL_ENUM algorithm)
 {
 	struct vmod_director_random *rand;
 
@@ -154,12 +291,21 @@ vmod_director_random(VRT_CTX, struct vmod_unidirectors_director *vd, VCL_INT cho
 		VRT_fail(ctx, "%s: LB method is already set", vd->vcl_name);
 		return;
 	}
+	if (choices > RANDOM_MAX_CHOICES) {
+		VRT_fail(ctx, "%s: random choices above %d", vd->vcl_name,
+		    RANDOM_MAX_CHOICES);
+		return;
+	}
 	udir_wrlock(vd);
 
 	ALLOC_OBJ(rand, VMOD_DIRECTOR_RANDOM_MAGIC);
 	vd->priv = rand;
 	AN(vd->priv);
 	rand->choices = choices;
+	if (!strcmp(algorithm, "alias")) {
+		vd->healthy_build = random_alias_build;
+		vd->healthy_free = random_alias_free;
+	}
 
 	vd->dir = VRT_AddDirector(ctx, random_methods, vd, "%s", vd->vcl_name);
 
@@ -167,9 +313,10 @@ vmod_director_random(VRT_CTX, struct vmod_unidirectors_director *vd, VCL_INT cho
 }
 
 VCL_VOID v_matchproto_()
-vmod_dyndirector_random(VRT_CTX, struct vmod_unidirectors_dyndirector *dyn, VCL_INT choices)
+vmod_dyndirector_random(VRT_CTX, struct vmod_unidirectors_dyndirector *dyn, VCL_INT choices,
+			VCL_ENUM algorithm)
 {
 	CHECK_OBJ_NOTNULL(ctx, VRT_CTX_MAGIC);
 	CHECK_OBJ_NOTNULL(dyn, VMOD_UNIDIRECTORS_DYNDIRECTOR_MAGIC);
-	vmod_director_random(ctx, dyn->vd, choices);
+	vmod_director_random(ctx, dyn->vd, choices, algorithm);
 }
@@ -41,12 +41,53 @@
 
 #include "udir.h"
 #include "dynamic.h"
+#include "rr_sched.h"
+
+enum rr_algorithm {
+	RR_INTERLEAVED = 0,
+	RR_SMOOTH,
+	RR_SHARDED,
+};
+
+/*
+ * Sharded tickets: a thread always uses the same shard, each on its own
+ * cache line, and shards start at different places of the schedule.
+ * Each shard is fair, so is the sum; there is no shared line written on
+ * the pick path as long as threads do not outnumber shards.
+ */
+#define RR_SHARDS				64
+
+struct rr_shard {
+	uint64_t				ticket;
+} __attribute__((aligned(64)));
+
+static unsigned rr_shard_next;
+static __thread unsigned rr_shard_id;
 
 struct vmod_director_round_robin {
 	unsigned				magic;
 #define VMOD_DIRECTOR_ROUND_ROBIN_MAGIC         0xe9537153
-	pthread_mutex_t			        mtx;
-	double				        w;
+	enum rr_algorithm			algorithm;
+	uint64_t				ticket;
+	struct rr_shard				*shard;
+};
+
+/*
+ * Smooth weighted round robin, as in nginx: every pick adds its weight
+ * to the current weight of each backend, takes the highest and removes
+ * the total weight from it. Picks of a heavy backend are evenly spaced.
+ * Current weights are per healthy set, carried over from the previous
+ * set of the same snapshot, and updated under a short lock.
+ */
+struct rr_smooth {
+	unsigned				magic;
+#define RR_SMOOTH_MAGIC				0x7d28c1e5
+	pthread_mutex_t				mtx;
+	unsigned				n;
+	double					tw;
+	be_idx_t				*u;	/* increasing */
+	double					*w;
+	double					*cur;
 };
 
 static void v_matchproto_(vdi_destroy_f)
@@ -57,54 +98,163 @@ rr_vdi_destroy(VCL_BACKEND dir)
 	CHECK_OBJ_NOTNULL(dir, DIRECTOR_MAGIC);
 	CAST_OBJ_NOTNULL(vd, dir->priv, VMOD_UNIDIRECTORS_DIRECTOR_MAGIC);
 	CAST_OBJ_NOTNULL(rr, vd->priv, VMOD_DIRECTOR_ROUND_ROBIN_MAGIC);
-	AZ(pthread_mutex_destroy(&rr->mtx));
+	free(rr->shard);
 	FREE_OBJ(rr);
 }
 
+static void * v_matchproto_(udir_healthy_build_f)
+rr_sched_build(const struct vmod_unidirectors_director *vd,
+	       const struct udir_snapshot *snap, const struct udir_healthy *hs)
+{
+	CHECK_OBJ_NOTNULL(vd, VMOD_UNIDIRECTORS_DIRECTOR_MAGIC);
+	CHECK_OBJ_NOTNULL(snap, UDIR_SNAPSHOT_MAGIC);
+	CHECK_OBJ_NOTNULL(hs, UDIR_HEALTHY_MAGIC);
+	if (hs->tw <= 0.0)
+		return (NULL);
+	/* NULL on allocation failure, see udir_healthy_rebuild() */
+	return (rr_sched_new(snap->weight, hs->be_idx, hs->n_backend));
+}
+
+static void
+rr_smooth_free(void *priv)
+{
+	struct rr_smooth *sm;
+
+	CAST_OBJ_NOTNULL(sm, priv, RR_SMOOTH_MAGIC);
+	AZ(pthread_mutex_destroy(&sm->mtx));
+	FREE_OBJ(sm);
+}
+
+static void * v_matchproto_(udir_healthy_build_f)
+rr_smooth_build(const struct vmod_unidirectors_director *vd,
+		const struct udir_snapshot *snap, const struct udir_healthy *hs)
+{
+	const struct udir_healthy *ohs;
+	struct rr_smooth *sm, *osm;
+	unsigned i, j, n = 0;
+
+	CHECK_OBJ_NOTNULL(vd, VMOD_UNIDIRECTORS_DIRECTOR_MAGIC);
+	CHECK_OBJ_NOTNULL(snap, UDIR_SNAPSHOT_MAGIC);
+	CHECK_OBJ_NOTNULL(hs, UDIR_HEALTHY_MAGIC);
+	for (i = 0; i < hs->n_backend; i++)
+		if (snap->weight[hs->be_idx[i]] > 0.0)
+			n++;
+	if (n == 0)
+		return (NULL);
+	sm = calloc(1, sizeof *sm + n * (sizeof *sm->u + 2 * sizeof *sm->w));
+	if (sm == NULL)
+		return (NULL);
+	sm->magic = RR_SMOOTH_MAGIC;
+	AZ(pthread_mutex_init(&sm->mtx, NULL));
+	sm->w = (void *)(sm + 1);
+	sm->cur = sm->w + n;
+	sm->u = (void *)(sm->cur + n);
+	for (i = 0; i < hs->n_backend; i++) {
+		if (snap->weight[hs->be_idx[i]] <= 0.0)
+			continue;
+		sm->u[sm->n] = hs->be_idx[i];
+		sm->w[sm->n] = snap->weight[hs->be_idx[i]];
+		sm->tw += sm->w[sm->n++];
+	}
+
+	/* the set being replaced, kept alive by the epoch of the caller */
+	ohs = __atomic_load_n(&vd->healthy, __ATOMIC_SEQ_CST);
+	if (ohs == NULL || ohs->gen != snap->gen || ohs->priv == NULL)
+		return (sm);
+	CAST_OBJ_NOTNULL(osm, ohs->priv, RR_SMOOTH_MAGIC);
+	AZ(pthread_mutex_lock(&osm->mtx));
+	for (i = j = 0; i < sm->n && j < osm->n; ) {
+		if (osm->u[j] < sm->u[i])
+			j++;
+		else if (osm->u[j] > sm->u[i])
+			i++;
+		else
+			sm->cur[i++] = osm->cur[j++];
+	}
+	AZ(pthread_mutex_unlock(&osm->mtx));
+	return (sm);
+}
+
+static unsigned
+rr_smooth_pick(struct rr_smooth *sm)
+{
+	unsigned i, best = 0;
+
+	AZ(pthread_mutex_lock(&sm->mtx));
+	for (i = 0; i < sm->n; i++) {
+		sm->cur[i] += sm->w[i];
+		if (sm->cur[i] > sm->cur[best])
+			best = i;
+	}
+	sm->cur[best] -= sm->tw;
+	AZ(pthread_mutex_unlock(&sm->mtx));
+	return (sm->u[best]);
+}
+
+static uint64_t
+rr_shard_ticket(struct vmod_director_round_robin *rr, const struct rr_sched *rs)
+{
+	unsigned id;
+	uint64_t t;
+
+	if (rr_shard_id == 0)
+		rr_shard_id = __atomic_add_fetch(&rr_shard_next, 1,
+		    __ATOMIC_RELAXED);
+	id = (rr_shard_id - 1) % RR_SHARDS;
+	t = __atomic_fetch_add(&rr->shard[id].ticket, 1, __ATOMIC_RELAXED);
+	return (t + id * rs->cycle / RR_SHARDS);
+}
+
+static VCL_BACKEND
+rr_select(struct vmod_director_round_robin *rr, const struct udir_snapshot *snap,
+	  const struct udir_healthy *hs)
+{
+	const struct rr_sched *rs;
+	struct rr_smooth *sm;
+	uint64_t t;
+	unsigned u;
+
+	if (hs->priv == NULL)
+		return (NULL);
+	if (rr->algorithm == RR_SMOOTH) {
+		CAST_OBJ_NOTNULL(sm, hs->priv, RR_SMOOTH_MAGIC);
+		u = rr_smooth_pick(sm);
+	} else {
+		CAST_OBJ_NOTNULL(rs, hs->priv, RR_SCHED_MAGIC);
+		if (rr->shard != NULL)
+			t = rr_shard_ticket(rr, rs);
+		else
+			t = __atomic_fetch_add(&rr->ticket, 1,
+			    __ATOMIC_RELAXED);
+		u = rr_sched_pick(rs, t);
+	}
+	assert(u < snap->n_backend);
+	CHECK_OBJ_NOTNULL(snap->backend[u], DIRECTOR_MAGIC);
+	return (snap->backend[u]);
+}
+
 static VCL_BACKEND v_matchproto_(vdi_resolve_f)
 rr_vdi_resolve(VRT_CTX, VCL_BACKEND dir)
 {
 	struct vmod_unidirectors_director *vd;
+	const struct udir_snapshot *snap;
+	const struct udir_healthy *hs;
         struct vmod_director_round_robin *rr;
-	unsigned u, h, n_backend = 0;
-	double w, tw = 0.0;
-	be_idx_t *be_idx = NULL;
-	VCL_BACKEND be, rbe = NULL;
+	VCL_BACKEND rbe;
 
 	CHECK_OBJ_NOTNULL(ctx, VRT_CTX_MAGIC);
 	CHECK_OBJ_NOTNULL(dir, DIRECTOR_MAGIC);
 	CAST_OBJ_NOTNULL(vd, dir->priv, VMOD_UNIDIRECTORS_DIRECTOR_MAGIC);
 
-	udir_rdlock(vd);
+	snap = udir_enter(vd);
 	CAST_OBJ_NOTNULL(rr, vd->priv, VMOD_DIRECTOR_ROUND_ROBIN_MAGIC);
-
-	if (WS_Reserve(ctx->ws, 0) >= vd->n_backend * sizeof(*be_idx)) {
-		be_idx = (void*)ctx->ws->f;
-		for (u = 0; u < vd->n_backend; u++) {
-			be = vd->backend[u];
-			CHECK_OBJ_NOTNULL(be, DIRECTOR_MAGIC);
-			if (VRT_Healthy(ctx, be, NULL)) {
-				be_idx[n_backend++] = u;
-				tw += vd->weight[u];
-			}
-		}
-	} else
-		VRT_fail(ctx, "%s: Workspace overflow on vdi_resolve", vd->vcl_name);
-	if (tw > 0.0) {
-		double i;
-		AN(be_idx);
-		AZ(pthread_mutex_lock(&rr->mtx));
-		w = modf(rr->w, &i);
-		h = w * n_backend;
-		u = be_idx[h];
-		assert(u < vd->n_backend);
-		rr->w = w + (1.0 - vd->weight[u] / tw);
-		AZ(pthread_mutex_unlock(&rr->mtx));
-		rbe = vd->backend[u];
-		CHECK_OBJ_NOTNULL(rbe, DIRECTOR_MAGIC);
+	hs = udir_healthy_get(ctx, vd, snap);
+	rbe = rr_select(rr, snap, hs);
+	if (rbe != NULL && !VRT_Healthy(ctx, rbe, NULL)) {
+		hs = udir_healthy_update(ctx, vd, snap, hs);
+		rbe = rr_select(rr, snap, hs);
 	}
-	WS_Release(ctx->ws, 0);
-	udir_unlock(vd);
+	udir_leave(vd);
 	return (rbe);
 }
 
@@ -113,14 +263,19 @@ static const struct vdi_methods rr_methods[1] = {{
 	.type =			"round-robin",
 	.healthy =		udir_vdi_healthy,
 	.resolve =		rr_vdi_resolve,
+#ifdef HAVE_STRUCT_VDI_METHODS_FIND
 	.find =			udir_vdi_find,
+#endif
+#ifdef HAVE_STRUCT_VDI_METHODS_UPTIME
 	.uptime =		udir_vdi_uptime,
+#endif
 	.destroy =		rr_vdi_destroy,
 	.list =                 udir_vdi_list,
 }};
 
 VCL_VOID v_matchproto_()
-vmod_director_round_robin(VRT_CTX, struct vmod_unidirectors_director *vd)
+vmod_director_round_robin(VRT_CTX, struct vmod_unidirectors_director *vd,
+			  VCL_ENUM algorithm)
 {
         struct vmod_director_round_robin *rr;
 
@@ -135,7 +290,20 @@ vmod_director_round_robin(VRT_CTX, struct vmod_unidirectors_director *vd)
 	ALLOC_OBJ(rr, VMOD_DIRECTOR_ROUND_ROBIN_MAGIC);
 	vd->priv = rr;
 	AN(vd->priv);
-	AZ(pthread_mutex_init(&rr->mtx, NULL));
+	if (!strcmp(algorithm, "smooth")) {
+		rr->algorithm = RR_SMOOTH;
+		vd->healthy_build = rr_smooth_build;
+		vd->healthy_free = rr_smooth_free;
+	} else {
+		if (!strcmp(algorithm, "sharded")) {
+			rr->algorithm = RR_SHARDED;
+			AZ(posix_memalign((void **)&rr->shard,
+			    sizeof *rr->shard, RR_SHARDS * sizeof *rr->shard));
+			memset(rr->shard, 0, RR_SHARDS * sizeof *rr->shard);
+		}
+		vd->healthy_build = rr_sched_build;
+		vd->healthy_free = free;
+	}
 
 	vd->dir = VRT_AddDirector(ctx, rr_methods, vd, "%s", vd->vcl_name);
 
@@ -143,9 +311,10 @@ vmod_director_round_robin(VRT_CTX, struct vmod_unidirectors_director *vd)
 }
 
 VCL_VOID v_matchproto_()
-vmod_dyndirector_round_robin(VRT_CTX, struct vmod_unidirectors_dyndirector *dyn)
+vmod_dyndirector_round_robin(VRT_CTX, struct vmod_unidirectors_dyndirector *dyn,
+			     VCL_ENUM algorithm)
 {
 	CHECK_OBJ_NOTNULL(ctx, VRT_CTX_MAGIC);
 	CHECK_OBJ_NOTNULL(dyn, VMOD_UNIDIRECTORS_DYNDIRECTOR_MAGIC);
-	vmod_director_round_robin(ctx, dyn->vd);
+	vmod_director_round_robin(ctx, dyn->vd, algorithm);
 }
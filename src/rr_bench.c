@@ -0,0 +1,169 @@
+/*-
+ * Copyright (c) 2019 GANDI SAS
+ * All rights reserved.
+ *
+ * Author: Emmanuel Hocdet <manu@gandi.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Multithreaded benchmark of the round robin pick: the former mutex
+ * protected floating point cursor, the director wide atomic ticket and
+ * the per thread sharded tickets of round_robin(sharded), the last two
+ * over the same schedule. Whether the ticket picks scale with threads
+ * depends on the core count, only a run on the target host tells.
+ *
+ * make rr_bench && ./rr_bench [picks per thread] [backends]
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "rr_sched.h"
+
+#define BENCH_MAX_THREADS	64
+#define BENCH_SHARDS		64	/* RR_SHARDS */
+
+struct bench_shard {
+	uint64_t		ticket;
+} __attribute__((aligned(64)));
+
+static unsigned long bench_n = 2000000;
+static unsigned bench_backends = 16;
+static double *bench_weight;
+static uint32_t *bench_idx;
+static struct rr_sched *bench_rs;
+
+static pthread_mutex_t bench_mtx = PTHREAD_MUTEX_INITIALIZER;
+static double bench_w;
+static double bench_tw;
+static uint64_t bench_ticket;
+static struct bench_shard bench_shard[BENCH_SHARDS];
+
+static volatile uint32_t bench_sink;
+
+static void *
+bench_mutex(void *priv)
+{
+	unsigned long i;
+	unsigned h, u;
+	double w, ip;
+
+	(void)priv;
+	for (i = 0; i < bench_n; i++) {
+		pthread_mutex_lock(&bench_mtx);
+		w = modf(bench_w, &ip);
+		h = w * bench_backends;
+		u = bench_idx[h];
+		bench_w = w + (1.0 - bench_weight[u] / bench_tw);
+		pthread_mutex_unlock(&bench_mtx);
+		bench_sink = u;
+	}
+	return (NULL);
+}
+
+static void *
+bench_ticket_pick(void *priv)
+{
+	unsigned long i;
+	uint64_t t;
+
+	(void)priv;
+	for (i = 0; i < bench_n; i++) {
+		t = __atomic_fetch_add(&bench_ticket, 1, __ATOMIC_RELAXED);
+		bench_sink = rr_sched_pick(bench_rs, t);
+	}
+	return (NULL);
+}
+
+/* as rr_shard_ticket(), a thread keeps its shard */
+static void *
+bench_shard_pick(void *priv)
+{
+	unsigned long i;
+	unsigned id;
+	uint64_t t;
+
+	id = *(const unsigned *)priv % BENCH_SHARDS;
+	for (i = 0; i < bench_n; i++) {
+		t = __atomic_fetch_add(&bench_shard[id].ticket, 1,
+		    __ATOMIC_RELAXED);
+		bench_sink = rr_sched_pick(bench_rs,
+		    t + id * bench_rs->cycle / BENCH_SHARDS);
+	}
+	return (NULL);
+}
+
+static double
+bench_run(void *(*func)(void *), unsigned n_thread)
+{
+	pthread_t thr[BENCH_MAX_THREADS];
+	unsigned id[BENCH_MAX_THREADS];
+	struct timespec t0, t1;
+	unsigned u;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (u = 0; u < n_thread; u++) {
+		id[u] = u;
+		if (pthread_create(&thr[u], NULL, func, &id[u]))
+			return (0.0);
+	}
+	for (u = 0; u < n_thread; u++)
+		pthread_join(thr[u], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return (n_thread * bench_n / ((t1.tv_sec - t0.tv_sec) +
+	    1e-9 * (t1.tv_nsec - t0.tv_nsec)) * 1e-6);
+}
+
+int
+main(int argc, char **argv)
+{
+	unsigned u;
+
+	if (argc > 1)
+		bench_n = strtoul(argv[1], NULL, 0);
+	if (argc > 2)
+		bench_backends = strtoul(argv[2], NULL, 0);
+	if (bench_backends == 0)
+		return (1);
+	bench_weight = calloc(bench_backends, sizeof *bench_weight);
+	bench_idx = calloc(bench_backends, sizeof *bench_idx);
+	if (bench_weight == NULL || bench_idx == NULL)
+		return (1);
+	for (u = 0; u < bench_backends; u++) {
+		bench_idx[u] = u;
+		bench_weight[u] = 1 + u % 3;
+		bench_tw += bench_weight[u];
+	}
+	bench_rs = rr_sched_new(bench_weight, bench_idx, bench_backends);
+	if (bench_rs == NULL)
+		return (1);
+
+	printf("%8s %12s %12s %12s  (Mpicks/s, %u backends)\n", "threads",
+	    "mutex", "ticket", "sharded", bench_backends);
+	for (u = 1; u <= BENCH_MAX_THREADS; u *= 2)
+		printf("%8u %12.2f %12.2f %12.2f\n", u,
+		    bench_run(bench_mutex, u), bench_run(bench_ticket_pick, u),
+		    bench_run(bench_shard_pick, u));
+	return (0);
+}
@@ -0,0 +1,191 @@
+/*-
+ * Copyright (c) 2019 GANDI SAS
+ * All rights reserved.
+ *
+ * Author: Emmanuel Hocdet <manu@gandi.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Weighted round robin schedule
+ *
+ * Weights are turned into small integers and the schedule is interleaved:
+ * round r serves, in order, every backend whose integer weight is above
+ * r. Backends are sorted by decreasing weight so that the backends of a
+ * round are a prefix of the order. A pick maps a ticket, taken with one
+ * atomic increment, to a backend with a binary search over the rounds:
+ * no lock and no shared state written but the ticket.
+ */
+
+#ifndef UNIDIRECTORS_RR_SCHED_H
+#define UNIDIRECTORS_RR_SCHED_H
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+ * Weights are small multiples of the lightest one most of the time (1, 2,
+ * 1.5...), they are then used as is. Otherwise the heaviest one is scaled
+ * to RR_WEIGHT_SCALE.
+ */
+#define RR_WEIGHT_SCALE		1000
+#define RR_WEIGHT_MULT		12
+
+struct rr_sched {
+	unsigned		magic;
+#define RR_SCHED_MAGIC		0x4f1c7a2d
+	unsigned		n_round;
+	uint64_t		cycle;		/* sum of integer weights */
+	uint64_t		*start;		/* first ticket of each round */
+	uint32_t		*order;		/* backends by decreasing weight */
+};
+
+struct rr_sched_item {
+	unsigned		iw;
+	uint32_t		u;
+};
+
+static int
+rr_sched_cmp(const void *a, const void *b)
+{
+	const struct rr_sched_item *ia = a, *ib = b;
+
+	if (ia->iw != ib->iw)
+		return (ia->iw > ib->iw ? -1 : 1);
+	return (ia->u < ib->u ? -1 : ia->u > ib->u);
+}
+
+static unsigned
+rr_sched_gcd(unsigned a, unsigned b)
+{
+	unsigned t;
+
+	while (b != 0) {
+		t = a % b;
+		a = b;
+		b = t;
+	}
+	return (a);
+}
+
+/* idx[n] backends, weight indexed by backend; NULL if no positive weight */
+static struct rr_sched *
+rr_sched_new(const double *weight, const uint32_t *idx, unsigned n)
+{
+	struct rr_sched_item *it;
+	struct rr_sched *rs;
+	unsigned i, k, r, g = 0, m = 0;
+	uint64_t *cnt;
+	double x, scale, wmax = 0.0, wmin = INFINITY;
+	unsigned mult;
+
+	for (i = 0; i < n; i++) {
+		if (weight[idx[i]] > wmax)
+			wmax = weight[idx[i]];
+		if (weight[idx[i]] > 0.0 && weight[idx[i]] < wmin)
+			wmin = weight[idx[i]];
+	}
+	if (wmax <= 0.0)
+		return (NULL);
+	scale = RR_WEIGHT_SCALE / wmax;
+	for (mult = 1; mult <= RR_WEIGHT_MULT; mult++) {
+		if (wmax * mult / wmin > RR_WEIGHT_SCALE)
+			break;
+		for (i = 0; i < n; i++) {
+			x = weight[idx[i]] * mult / wmin;
+			if (weight[idx[i]] > 0.0 && fabs(x - round(x)) > 1e-6)
+				break;
+		}
+		if (i == n) {
+			scale = mult / wmin;
+			break;
+		}
+	}
+	it = malloc(n * sizeof *it);
+	if (it == NULL)
+		return (NULL);
+	for (i = k = 0; i < n; i++) {
+		if (weight[idx[i]] <= 0.0)
+			continue;
+		it[k].u = idx[i];
+		it[k].iw = lround(weight[idx[i]] * scale);
+		if (it[k].iw == 0)
+			it[k].iw = 1;
+		g = rr_sched_gcd(it[k].iw, g);
+		k++;
+	}
+	for (i = 0; i < k; i++) {
+		it[i].iw /= g;
+		if (it[i].iw > m)
+			m = it[i].iw;
+	}
+	qsort(it, k, sizeof *it, rr_sched_cmp);
+
+	rs = calloc(1, sizeof *rs + (m + 1) * sizeof *rs->start +
+	    k * sizeof *rs->order);
+	if (rs == NULL) {
+		free(it);
+		return (NULL);
+	}
+	rs->magic = RR_SCHED_MAGIC;
+	rs->n_round = m;
+	rs->start = (void *)(rs + 1);
+	rs->order = (void *)(rs->start + m + 1);
+	/* backends in round r: count of integer weights above r */
+	cnt = rs->start;
+	for (i = 0; i < k; i++) {
+		rs->order[i] = it[i].u;
+		cnt[it[i].iw - 1]++;
+	}
+	for (r = m - 1; r > 0; r--)
+		cnt[r - 1] += cnt[r];
+	/* prefix sums in place */
+	for (r = 0, rs->cycle = 0; r <= m; r++) {
+		uint64_t c = r < m ? cnt[r] : 0;
+
+		rs->start[r] = rs->cycle;
+		rs->cycle += c;
+	}
+	free(it);
+	return (rs);
+}
+
+static uint32_t
+rr_sched_pick(const struct rr_sched *rs, uint64_t ticket)
+{
+	const uint64_t *base;
+	uint64_t t;
+	unsigned n, half;
+
+	/* walk the schedule backwards, the historic round robin order */
+	t = (rs->cycle - ticket % rs->cycle) % rs->cycle;
+	base = rs->start;
+	n = rs->n_round;
+	while (n > 1) {
+		half = n / 2;
+		base = (base[half] <= t) ? base + half : base;
+		n -= half;
+	}
+	return (rs->order[t - *base]);
+}
+
+#endif
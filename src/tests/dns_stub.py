@@ -0,0 +1,72 @@
+#!/usr/bin/env python3
+#
+# Minimal UDP DNS server for the lookup tests.
+#
+# usage: dns_stub.py ADDR PORT TTL RR [RR...]
+#
+# RR is "NAME TYPE ANSWERS", TYPE A or SRV. ANSWERS are answer sets
+# separated by '|', served in turn one per query, the last one is kept.
+# A set is a comma separated list of IPs for A, of
+# PRIORITY:WEIGHT:PORT:TARGET for SRV. Other queries get an empty answer.
+
+import socket
+import struct
+import sys
+
+TYPES = {"A": 1, "SRV": 33}
+
+
+def name_wire(name):
+    return b"".join(bytes([len(l)]) + l.encode()
+                    for l in name.strip(".").split(".")) + b"\0"
+
+
+def rdata(qtype, rec):
+    if qtype == 1:
+        return socket.inet_aton(rec)
+    prio, weight, port, target = rec.split(":")
+    return struct.pack("!HHH", int(prio), int(weight), int(port)) + \
+        name_wire(target)
+
+
+def question(msg):
+    i = 12
+    labels = []
+    while msg[i]:
+        labels.append(msg[i + 1:i + 1 + msg[i]].decode().lower())
+        i += 1 + msg[i]
+    qtype, = struct.unpack("!H", msg[i + 1:i + 3])
+    return ".".join(labels), qtype, i + 5
+
+
+def main():
+    addr, port, ttl = sys.argv[1:4]
+    zone = {}
+    for rr in sys.argv[4:]:
+        name, rtype, answers = rr.split()
+        zone[(name.lower(), TYPES[rtype])] = \
+            [a.split(",") for a in answers.split("|")]
+    served = {}
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.bind((addr, int(port)))
+    while True:
+        msg, peer = sock.recvfrom(512)
+        try:
+            qname, qtype, end = question(msg)
+        except (IndexError, UnicodeDecodeError, struct.error):
+            continue
+        answer = []
+        sets = zone.get((qname, qtype))
+        if sets:
+            n = served.get((qname, qtype), 0)
+            served[(qname, qtype)] = n + 1
+            for rec in sets[min(n, len(sets) - 1)]:
+                rd = rdata(qtype, rec)
+                answer.append(struct.pack("!HHHIH", 0xc00c, qtype, 1,
+                                          int(ttl), len(rd)) + rd)
+        hdr = struct.pack("!HHHHHH", struct.unpack("!H", msg[:2])[0],
+                          0x8180, 1, len(answer), 0, 0)
+        sock.sendto(hdr + msg[12:end] + b"".join(answer), peer)
+
+
+main()
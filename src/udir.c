@@ -33,17 +33,223 @@
 
 #include "config.h"
 
+#include <math.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "cache/cache.h"
 #include "cache/cache_director.h"
 
+#include "vrnd.h"
 #include "vsb.h"
 #include "vbm.h"
+#include "vtim.h"
 
 #include "udir.h"
 
+/*
+ * xoshiro256** per thread, off the VRND lock. Seeded on first use in
+ * each thread from VRND_RandomTestable() through splitmix64. Threads are
+ * seeded in scheduling order and keep their state across debug.srandom,
+ * so picks are not reproducible from it: tests check properties of the
+ * picks, not sequences.
+ */
+static __thread uint64_t udir_random_state[4];
+
+static inline uint64_t
+udir_rotl(uint64_t x, int k)
+{
+	return ((x << k) | (x >> (64 - k)));
+}
+
+static void
+udir_random_seed(uint64_t *s)
+{
+	uint64_t x, z;
+	unsigned i;
+
+	x = (uint64_t)VRND_RandomTestable() << 31 ^ VRND_RandomTestable();
+	for (i = 0; i < 4; i++) {
+		z = (x += 0x9e3779b97f4a7c15ULL);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		s[i] = z ^ (z >> 31);
+	}
+}
+
+/* uniform in [0, 1) */
+double
+udir_random(void)
+{
+	uint64_t *s = udir_random_state;
+	uint64_t r, t;
+
+	if ((s[0] | s[1] | s[2] | s[3]) == 0)
+		udir_random_seed(s);
+	r = udir_rotl(s[1] * 5, 7) * 9;
+	t = s[1] << 17;
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = udir_rotl(s[3], 45);
+	return ((r >> 11) * 0x1p-53);
+}
+
+static struct udir_stat *
+udir_stat_new(void)
+{
+	struct udir_stat *st;
+
+	AZ(posix_memalign((void **)&st, sizeof *st, sizeof *st));
+	memset(st, 0, sizeof *st);
+	st->magic = UDIR_STAT_MAGIC;
+	st->refcnt = 1;
+	AZ(pthread_mutex_init(&st->mtx, NULL));
+	return (st);
+}
+
+static struct udir_stat *
+udir_stat_ref(struct udir_stat *st)
+{
+	CHECK_OBJ_NOTNULL(st, UDIR_STAT_MAGIC);
+	__atomic_add_fetch(&st->refcnt, 1, __ATOMIC_RELAXED);
+	return (st);
+}
+
+static void
+udir_stat_unref(struct udir_stat *st)
+{
+	CHECK_OBJ_NOTNULL(st, UDIR_STAT_MAGIC);
+	if (__atomic_sub_fetch(&st->refcnt, 1, __ATOMIC_ACQ_REL) > 0)
+		return;
+	AZ(st->inflight);
+	AZ(pthread_mutex_destroy(&st->mtx));
+	free(st);
+}
+
+/*
+ * Peak EWMA of st and the time of its last sample, without the lock:
+ * the writers, serialized by st->mtx, make seq odd while they store
+ * and a reader seeing it odd or changed reads again.
+ */
+void
+udir_stat_ewma(const struct udir_stat *st, double *ewma, double *t)
+{
+	unsigned s;
+
+	CHECK_OBJ_NOTNULL(st, UDIR_STAT_MAGIC);
+	AN(ewma);
+	AN(t);
+	do {
+		s = __atomic_load_n(&st->seq, __ATOMIC_ACQUIRE);
+		__atomic_load(&st->ewma, ewma, __ATOMIC_RELAXED);
+		__atomic_load(&st->t_ewma, t, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((s & 1) || __atomic_load_n(&st->seq, __ATOMIC_RELAXED) != s);
+}
+
+/*
+ * A fetch task using a backend of a director. It is ended by the task
+ * cleanup, or by a new resolve of the same director in the same task
+ * (retry). Only a task ended by its cleanup gives a duration sample.
+ */
+struct udir_task {
+	unsigned				magic;
+#define UDIR_TASK_MAGIC				0x5a3c8e71
+	struct udir_stat			*stat;
+	unsigned				*inflight;	/* director total */
+	double					t_start;
+	double					decay;
+};
+
+static void
+udir_task_end(struct udir_task *tk, int sample)
+{
+	struct udir_stat *st;
+	double now, d, e, w;
+	unsigned s;
+
+	CHECK_OBJ_NOTNULL(tk, UDIR_TASK_MAGIC);
+	st = tk->stat;
+	CHECK_OBJ_NOTNULL(st, UDIR_STAT_MAGIC);
+	tk->stat = NULL;
+	if (sample && tk->decay > 0.0 && tk->t_start > 0.0) {
+		now = VTIM_real();
+		d = now - tk->t_start;
+		AZ(pthread_mutex_lock(&st->mtx));
+		/* peak EWMA: up at once, down with the decay */
+		e = st->ewma;
+		if (d < e) {
+			w = exp(-(now - st->t_ewma) / tk->decay);
+			d = e * w + d * (1.0 - w);
+		}
+		s = st->seq;
+		__atomic_store_n(&st->seq, s + 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		__atomic_store(&st->ewma, &d, __ATOMIC_RELAXED);
+		__atomic_store(&st->t_ewma, &now, __ATOMIC_RELAXED);
+		__atomic_store_n(&st->seq, s + 2, __ATOMIC_RELEASE);
+		AZ(pthread_mutex_unlock(&st->mtx));
+	}
+	__atomic_sub_fetch(&st->inflight, 1, __ATOMIC_RELAXED);
+	if (tk->inflight != NULL)
+		__atomic_sub_fetch(tk->inflight, 1, __ATOMIC_RELAXED);
+	udir_stat_unref(st);
+}
+
+static void
+udir_task_fini(void *priv)
+{
+	struct udir_task *tk;
+
+	CAST_OBJ_NOTNULL(tk, priv, UDIR_TASK_MAGIC);
+	if (tk->stat != NULL)
+		udir_task_end(tk, 1);
+}
+
+/*
+ * Count a request in flight on st until the end of the task, and on
+ * total if not NULL. A director-wide total is a shared cache line on the
+ * fetch path, only bounded loads ask for it.
+ */
+void
+udir_task_track(VRT_CTX, const struct vmod_unidirectors_director *vd,
+		struct udir_stat *st, double decay, unsigned *total)
+{
+	struct vmod_priv *p;
+	struct udir_task *tk;
+
+	CHECK_OBJ_NOTNULL(ctx, VRT_CTX_MAGIC);
+	CHECK_OBJ_NOTNULL(vd, VMOD_UNIDIRECTORS_DIRECTOR_MAGIC);
+	CHECK_OBJ_NOTNULL(st, UDIR_STAT_MAGIC);
+
+	p = VRT_priv_task(ctx, vd);
+	if (p == NULL)
+		return;
+	if (p->priv == NULL) {
+		tk = WS_Alloc(ctx->ws, sizeof *tk);
+		if (tk == NULL)
+			return;
+		INIT_OBJ(tk, UDIR_TASK_MAGIC);
+		p->priv = tk;
+		p->free = udir_task_fini;
+	} else {
+		CAST_OBJ_NOTNULL(tk, p->priv, UDIR_TASK_MAGIC);
+		if (tk->stat != NULL)
+			udir_task_end(tk, 0);
+	}
+	__atomic_add_fetch(&st->inflight, 1, __ATOMIC_RELAXED);
+	if (total != NULL)
+		__atomic_add_fetch(total, 1, __ATOMIC_RELAXED);
+	tk->stat = udir_stat_ref(st);
+	tk->inflight = total;
+	/* the clock only for a duration sample */
+	tk->t_start = decay > 0.0 ? VTIM_real() : 0.0;
+	tk->decay = decay;
+}
+
 static void
 udir_expand(struct vmod_unidirectors_director *vd, unsigned n)
 {
@@ -53,9 +259,260 @@ udir_expand(struct vmod_unidirectors_director *vd, unsigned n)
 	AN(vd->backend);
 	vd->weight = realloc(vd->weight, n * sizeof *vd->weight);
 	AN(vd->weight);
+	vd->priority = realloc(vd->priority, n * sizeof *vd->priority);
+	AN(vd->priority);
+	vd->stat = realloc(vd->stat, n * sizeof *vd->stat);
+	AN(vd->stat);
 	vd->l_backend = n;
 }
 
+/* LB method data of a snapshot, vd->mtx held */
+static void
+udir_snapshot_build(const struct vmod_unidirectors_director *vd,
+		    struct udir_snapshot *snap)
+{
+	CHECK_OBJ_NOTNULL(vd, VMOD_UNIDIRECTORS_DIRECTOR_MAGIC);
+	CHECK_OBJ_NOTNULL(snap, UDIR_SNAPSHOT_MAGIC);
+	AZ(snap->built);
+	if (vd->snapshot_build != NULL) {
+		snap->priv = vd->snapshot_build(vd, snap);
+		snap->priv_free = vd->snapshot_free;
+	}
+	__atomic_store_n(&snap->built, 1, __ATOMIC_RELEASE);
+}
+
+static struct udir_snapshot *
+udir_snapshot_new(const struct vmod_unidirectors_director *vd)
+{
+	struct udir_snapshot *snap;
+	unsigned n, u;
+
+	CHECK_OBJ_NOTNULL(vd, VMOD_UNIDIRECTORS_DIRECTOR_MAGIC);
+	n = vd->n_backend;
+	/* one allocation: header, weights, backends, stats then priorities */
+	snap = calloc(1, sizeof *snap + n * (sizeof *snap->weight +
+	    sizeof *snap->backend + sizeof *snap->stat +
+	    sizeof *snap->priority));
+	AN(snap);
+	snap->magic = UDIR_SNAPSHOT_MAGIC;
+	snap->gen = vd->gen;
+	snap->n_backend = n;
+	snap->weight = (void *)(snap + 1);
+	snap->backend = (void *)(snap->weight + n);
+	snap->stat = (void *)(snap->backend + n);
+	snap->priority = (void *)(snap->stat + n);
+	for (u = 0; u < n; u++)
+		snap->stat[u] = udir_stat_ref(vd->stat[u]);
+	if (n > 0) {
+		memcpy(snap->weight, vd->weight, n * sizeof *snap->weight);
+		memcpy(snap->backend, vd->backend, n * sizeof *snap->backend);
+		memcpy(snap->priority, vd->priority,
+		    n * sizeof *snap->priority);
+		snap->uniform = snap->weight[0] > 0.0;
+		for (u = 1; u < n && snap->uniform; u++)
+			snap->uniform = snap->weight[u] == snap->weight[0];
+	}
+	if (!vd->lazy)
+		udir_snapshot_build(vd, snap);
+	return (snap);
+}
+
+static void
+udir_snapshot_free(void *priv)
+{
+	struct udir_snapshot *snap;
+	unsigned u;
+
+	CAST_OBJ_NOTNULL(snap, priv, UDIR_SNAPSHOT_MAGIC);
+	if (snap->priv != NULL)
+		snap->priv_free(snap->priv);
+	for (u = 0; u < snap->n_backend; u++)
+		udir_stat_unref(snap->stat[u]);
+	FREE_OBJ(snap);
+}
+
+static void
+udir_publish(struct vmod_unidirectors_director *vd)
+{
+	struct udir_snapshot *snap;
+
+	CHECK_OBJ_NOTNULL(vd, VMOD_UNIDIRECTORS_DIRECTOR_MAGIC);
+	vd->gen++;
+	snap = udir_snapshot_new(vd);
+	snap = __atomic_exchange_n(&vd->snapshot, snap, __ATOMIC_SEQ_CST);
+	udir_epoch_retire(snap, udir_snapshot_free);
+	vd->dirty = 0;
+	vd->lazy = 0;
+}
+
+static struct udir_healthy *
+udir_healthy_new(VRT_CTX, const struct vmod_unidirectors_director *vd,
+		 const struct udir_snapshot *snap, unsigned health_gen, double now)
+{
+	struct udir_healthy *hs;
+	VCL_BACKEND be;
+	unsigned u;
+
+	CHECK_OBJ_NOTNULL(snap, UDIR_SNAPSHOT_MAGIC);
+	hs = calloc(1, sizeof *hs +
+	    snap->n_backend * (sizeof *hs->cw + sizeof *hs->be_idx) +
+	    ((snap->n_backend + 31) >> 5) * sizeof *hs->bitmap);
+	AN(hs);
+	hs->magic = UDIR_HEALTHY_MAGIC;
+	hs->gen = snap->gen;
+	hs->health_gen = health_gen;
+	hs->t_built = now;
+	hs->cw = (void *)(hs + 1);
+	hs->be_idx = (void *)(hs->cw + snap->n_backend);
+	hs->bitmap = (void *)(hs->be_idx + snap->n_backend);
+	for (u = 0; u < snap->n_backend; u++) {
+		be = snap->backend[u];
+		CHECK_OBJ_NOTNULL(be, DIRECTOR_MAGIC);
+		if (VRT_Healthy(ctx, be, NULL)) {
+			hs->tw += snap->weight[u];
+			hs->cw[hs->n_backend] = hs->tw;
+			hs->be_idx[hs->n_backend++] = u;
+			hs->bitmap[u >> 5] |= 1U << (u & 31);
+		}
+	}
+	if (vd->healthy_build != NULL) {
+		hs->priv = vd->healthy_build(vd, snap, hs);
+		hs->priv_free = vd->healthy_free;
+	}
+	return (hs);
+}
+
+/*
+ * Position in the healthy set of the first cumulative weight above r,
+ * 0 <= r < hs->tw. Same pick as a linear walk adding up the weights.
+ */
+unsigned
+udir_healthy_pick(const struct udir_healthy *hs, double r)
+{
+	const double *base;
+	unsigned n, half;
+
+	CHECK_OBJ_NOTNULL(hs, UDIR_HEALTHY_MAGIC);
+	AN(hs->n_backend);
+	base = hs->cw;
+	n = hs->n_backend;
+	while (n > 1) {
+		half = n / 2;
+		base = (base[half - 1] <= r) ? base + half : base;
+		n -= half;
+	}
+	return (base - hs->cw);
+}
+
+static void
+udir_healthy_free(void *priv)
+{
+	struct udir_healthy *hs;
+
+	CAST_OBJ_NOTNULL(hs, priv, UDIR_HEALTHY_MAGIC);
+	if (hs->priv != NULL)
+		hs->priv_free(hs->priv);
+	FREE_OBJ(hs);
+}
+
+static int
+udir_healthy_fresh(const struct udir_healthy *hs, const struct udir_snapshot *snap,
+		   unsigned health_gen, double now)
+{
+	if (hs == NULL || hs->gen != snap->gen || hs->health_gen != health_gen)
+		return (0);
+	/* nothing healthy: look again for a backend coming back */
+	if (hs->n_backend == 0 && snap->n_backend > 0)
+		return (0);
+	return (now - hs->t_built < UDIR_HEALTHY_TTL);
+}
+
+static const struct udir_healthy *
+udir_healthy_rebuild(VRT_CTX, struct vmod_unidirectors_director *vd,
+		     const struct udir_snapshot *snap, double now)
+{
+	struct udir_healthy *hs, *ohs;
+	unsigned health_gen;
+
+	health_gen = __atomic_load_n(&vd->health_gen, __ATOMIC_SEQ_CST);
+	ohs = __atomic_load_n(&vd->healthy, __ATOMIC_SEQ_CST);
+	if (udir_healthy_fresh(ohs, snap, health_gen, now))
+		return (ohs);
+	hs = udir_healthy_new(ctx, vd, snap, health_gen, now);
+	if (vd->healthy_build != NULL && hs->priv == NULL && hs->tw > 0.0) {
+		/* build failed: keep the current set, retried on next use */
+		if (ohs != NULL && ohs->gen == snap->gen) {
+			udir_healthy_free(hs);
+			return (ohs);
+		}
+		udir_epoch_retire(hs, udir_healthy_free);
+		return (hs);
+	}
+	if (snap != __atomic_load_n(&vd->snapshot, __ATOMIC_SEQ_CST)) {
+		/* snapshot superseded: the set only lives for this reader */
+		udir_epoch_retire(hs, udir_healthy_free);
+		return (hs);
+	}
+	udir_epoch_retire(__atomic_exchange_n(&vd->healthy, hs,
+	    __ATOMIC_SEQ_CST), udir_healthy_free);
+	return (hs);
+}
+
+/*
+ * Healthy set for a snapshot taken with udir_enter(), valid until
+ * udir_leave(). A stale set is rebuilt by one thread at a time, the
+ * others keep using it meanwhile.
+ */
+const struct udir_healthy *
+udir_healthy_get(VRT_CTX, struct vmod_unidirectors_director *vd,
+		 const struct udir_snapshot *snap)
+{
+	const struct udir_healthy *hs;
+	double now;
+
+	CHECK_OBJ_NOTNULL(ctx, VRT_CTX_MAGIC);
+	CHECK_OBJ_NOTNULL(vd, VMOD_UNIDIRECTORS_DIRECTOR_MAGIC);
+	CHECK_OBJ_NOTNULL(snap, UDIR_SNAPSHOT_MAGIC);
+
+	now = ctx->now > 0. ? ctx->now : VTIM_real();
+	hs = __atomic_load_n(&vd->healthy, __ATOMIC_SEQ_CST);
+	if (hs != NULL && hs->gen == snap->gen) {
+		if (udir_healthy_fresh(hs, snap,
+		    __atomic_load_n(&vd->health_gen, __ATOMIC_SEQ_CST), now))
+			return (hs);
+		if (pthread_mutex_trylock(&vd->hmtx))
+			return (hs);
+	} else
+		AZ(pthread_mutex_lock(&vd->hmtx));
+	hs = udir_healthy_rebuild(ctx, vd, snap, now);
+	AZ(pthread_mutex_unlock(&vd->hmtx));
+	CHECK_OBJ_NOTNULL(hs, UDIR_HEALTHY_MAGIC);
+	return (hs);
+}
+
+/* A resolver picked a sick backend from hs: invalidate and rebuild now */
+const struct udir_healthy *
+udir_healthy_update(VRT_CTX, struct vmod_unidirectors_director *vd,
+		    const struct udir_snapshot *snap, const struct udir_healthy *hs)
+{
+	unsigned health_gen;
+	double now;
+
+	CHECK_OBJ_NOTNULL(ctx, VRT_CTX_MAGIC);
+	CHECK_OBJ_NOTNULL(vd, VMOD_UNIDIRECTORS_DIRECTOR_MAGIC);
+	CHECK_OBJ_NOTNULL(hs, UDIR_HEALTHY_MAGIC);
+
+	health_gen = hs->health_gen;
+	(void)__atomic_compare_exchange_n(&vd->health_gen, &health_gen,
+	    health_gen + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	now = ctx->now > 0. ? ctx->now : VTIM_real();
+	AZ(pthread_mutex_lock(&vd->hmtx));
+	hs = udir_healthy_rebuild(ctx, vd, snap, now);
+	AZ(pthread_mutex_unlock(&vd->hmtx));
+	CHECK_OBJ_NOTNULL(hs, UDIR_HEALTHY_MAGIC);
+	return (hs);
+}
+
 static void
 udir_new(struct vmod_unidirectors_director **vdp, const char *vcl_name)
 {
@@ -67,50 +524,88 @@ udir_new(struct vmod_unidirectors_director **vdp, const char *vcl_name)
 	ALLOC_OBJ(vd, VMOD_UNIDIRECTORS_DIRECTOR_MAGIC);
 	AN(vd);
 	*vdp = vd;
-	AZ(pthread_rwlock_init(&vd->mtx, NULL));
+	AZ(pthread_mutex_init(&vd->mtx, NULL));
+	AZ(pthread_mutex_init(&vd->hmtx, NULL));
 	vd->vcl_name = vcl_name; // XXX dup ?
+	vd->snapshot = udir_snapshot_new(vd);
 }
 
 static void
 udir_delete(struct vmod_unidirectors_director **vdp)
 {
 	struct vmod_unidirectors_director *vd;
+	unsigned u;
 
 	TAKE_OBJ_NOTNULL(vd, vdp, VMOD_UNIDIRECTORS_DIRECTOR_MAGIC);
 
 	if (vd->dir)
 	        VRT_DelDirector(&vd->dir);
 
+	if (vd->healthy)
+		udir_healthy_free(vd->healthy);
+	udir_snapshot_free(vd->snapshot);
+	for (u = 0; u < vd->n_backend; u++)
+		udir_stat_unref(vd->stat[u]);
 	free(vd->backend);
 	free(vd->weight);
-	AZ(pthread_rwlock_destroy(&vd->mtx));
+	free(vd->priority);
+	free(vd->stat);
+	AZ(pthread_mutex_destroy(&vd->hmtx));
+	AZ(pthread_mutex_destroy(&vd->mtx));
 	FREE_OBJ(vd);
 }
 
+/*
+ * Read side: no lock, the snapshot stays valid until udir_leave().
+ * Backends added in vcl_init are published without the LB method data,
+ * rebuilding a maglev table or a ring per add_backend() is wasted, the
+ * first reader builds it for the final snapshot.
+ */
+const struct udir_snapshot *
+udir_enter(struct vmod_unidirectors_director *vd)
+{
+	struct udir_snapshot *snap;
+
+	CHECK_OBJ_NOTNULL(vd, VMOD_UNIDIRECTORS_DIRECTOR_MAGIC);
+	udir_epoch_enter();
+	snap = __atomic_load_n(&vd->snapshot, __ATOMIC_SEQ_CST);
+	CHECK_OBJ_NOTNULL(snap, UDIR_SNAPSHOT_MAGIC);
+	if (!__atomic_load_n(&snap->built, __ATOMIC_ACQUIRE)) {
+		AZ(pthread_mutex_lock(&vd->mtx));
+		if (!snap->built)
+			udir_snapshot_build(vd, snap);
+		AZ(pthread_mutex_unlock(&vd->mtx));
+	}
+	return (snap);
+}
+
 void
-udir_rdlock(struct vmod_unidirectors_director *vd)
+udir_leave(struct vmod_unidirectors_director *vd)
 {
 	CHECK_OBJ_NOTNULL(vd, VMOD_UNIDIRECTORS_DIRECTOR_MAGIC);
-	AZ(pthread_rwlock_rdlock(&vd->mtx));
+	udir_epoch_leave();
 }
 
 void
 udir_wrlock(struct vmod_unidirectors_director *vd)
 {
 	CHECK_OBJ_NOTNULL(vd, VMOD_UNIDIRECTORS_DIRECTOR_MAGIC);
-	AZ(pthread_rwlock_wrlock(&vd->mtx));
+	AZ(pthread_mutex_lock(&vd->mtx));
 }
 
+/* Write side: publish changes made under the lock */
 void
 udir_unlock(struct vmod_unidirectors_director *vd)
 {
 	CHECK_OBJ_NOTNULL(vd, VMOD_UNIDIRECTORS_DIRECTOR_MAGIC);
-	AZ(pthread_rwlock_unlock(&vd->mtx));
+	if (vd->dirty)
+		udir_publish(vd);
+	AZ(pthread_mutex_unlock(&vd->mtx));
 }
 
 unsigned
 _udir_add_backend(VRT_CTX, struct vmod_unidirectors_director *vd,
-		  VCL_BACKEND be, double weight)
+		  VCL_BACKEND be, double weight, unsigned priority)
 {
 	unsigned u;
 
@@ -122,16 +617,20 @@ _udir_add_backend(VRT_CTX, struct vmod_unidirectors_director *vd,
 	}
 	CHECK_OBJ(be, DIRECTOR_MAGIC);
 	if (vd->n_backend >= UDIR_MAX_BACKEND) {
-		VRT_fail(ctx, "%s: backend cannot be added (max %d)",
+		VRT_fail(ctx, "%s: backend cannot be added (max %u)",
 			 vd->vcl_name, UDIR_MAX_BACKEND);
 		return (0);
 	}
+	/* grow geometrically, large dynamic pools are filled one by one */
 	if (vd->n_backend >= vd->l_backend)
-		udir_expand(vd, vd->l_backend + 16);
+		udir_expand(vd, vd->l_backend < 16 ? 16 : vd->l_backend * 2);
 	assert(vd->n_backend < vd->l_backend);
 	u = vd->n_backend++;
 	vd->backend[u] = be;
 	vd->weight[u] = weight;
+	vd->priority[u] = priority;
+	vd->stat[u] = udir_stat_new();
+	vd->dirty = 1;
 	return (1);
 }
 
@@ -153,17 +652,104 @@ _udir_remove_backend(VRT_CTX, struct vmod_unidirectors_director *vd,
 			break;
 	if (u == vd->n_backend)
 		return (0);
+	udir_stat_unref(vd->stat[u]);
 	n = (vd->n_backend - u) - 1;
 	memmove(&vd->backend[u], &vd->backend[u+1], n * sizeof(vd->backend[0]));
 	memmove(&vd->weight[u], &vd->weight[u+1], n * sizeof(vd->weight[0]));
+	memmove(&vd->priority[u], &vd->priority[u+1],
+	    n * sizeof(vd->priority[0]));
+	memmove(&vd->stat[u], &vd->stat[u+1], n * sizeof(vd->stat[0]));
 	vd->n_backend--;
+	vd->dirty = 1;
 	return (1);
 }
 
+static int
+udir_change_cmp(const void *a, const void *b)
+{
+	const struct udir_change * const *ca = a, * const *cb = b;
+	uintptr_t pa = (uintptr_t)(*ca)->be, pb = (uintptr_t)(*cb)->be;
+
+	return (pa < pb ? -1 : pa > pb);
+}
+
+/*
+ * A batch in one pass over the backends, instead of a search and a
+ * memmove per removal: the changes are sorted by backend, each backend
+ * of the director looks its change up and the kept ones are compacted.
+ * Present backends keep their stat. Changes of absent backends are
+ * appended in order.
+ */
+void
+_udir_change_backends(VRT_CTX, struct vmod_unidirectors_director *vd,
+		      struct udir_change *chg, unsigned n)
+{
+	struct udir_change key, *kp, **idx, **cp;
+	unsigned i, u, v;
+
+	CHECK_OBJ_NOTNULL(vd, VMOD_UNIDIRECTORS_DIRECTOR_MAGIC);
+	if (n == 0)
+		return;
+	AN(chg);
+	idx = malloc(n * sizeof *idx);
+	AN(idx);
+	for (i = 0; i < n; i++) {
+		CHECK_OBJ_NOTNULL(chg[i].be, DIRECTOR_MAGIC);
+		chg[i].done = 0;
+		idx[i] = &chg[i];
+	}
+	qsort(idx, n, sizeof *idx, udir_change_cmp);
+
+	kp = &key;
+	for (u = v = 0; u < vd->n_backend; u++) {
+		key.be = vd->backend[u];
+		cp = bsearch(&kp, idx, n, sizeof *idx, udir_change_cmp);
+		if (cp != NULL) {
+			(*cp)->done = 1;
+			if ((*cp)->remove) {
+				udir_stat_unref(vd->stat[u]);
+				continue;
+			}
+			vd->weight[u] = (*cp)->weight;
+			vd->priority[u] = (*cp)->priority;
+		}
+		if (v != u) {
+			vd->backend[v] = vd->backend[u];
+			vd->weight[v] = vd->weight[u];
+			vd->priority[v] = vd->priority[u];
+			vd->stat[v] = vd->stat[u];
+		}
+		v++;
+	}
+	vd->n_backend = v;
+	free(idx);
+
+	for (i = 0; i < n; i++) {
+		if (chg[i].done || chg[i].remove)
+			continue;
+		if (vd->n_backend >= UDIR_MAX_BACKEND) {
+			VRT_fail(ctx, "%s: backend cannot be added (max %u)",
+				 vd->vcl_name, UDIR_MAX_BACKEND);
+			break;
+		}
+		if (vd->n_backend >= vd->l_backend)
+			udir_expand(vd, vd->l_backend < 16 ? 16 :
+			    vd->l_backend * 2);
+		u = vd->n_backend++;
+		vd->backend[u] = chg[i].be;
+		vd->weight[u] = chg[i].weight;
+		vd->priority[u] = chg[i].priority;
+		vd->stat[u] = udir_stat_new();
+		chg[i].done = 1;
+	}
+	vd->dirty = 1;
+}
+
 VCL_BOOL v_matchproto_(vdi_healthy_f)
 udir_vdi_healthy(VRT_CTX, VCL_BACKEND dir, VCL_TIME *changed)
 {
 	struct vmod_unidirectors_director *vd;
+	const struct udir_snapshot *snap;
 	unsigned retval = 0;
 	VCL_BACKEND be;
 	unsigned u;
@@ -173,11 +759,11 @@ udir_vdi_healthy(VRT_CTX, VCL_BACKEND dir, VCL_TIME *changed)
 	CHECK_OBJ_NOTNULL(dir, DIRECTOR_MAGIC);
 	CAST_OBJ_NOTNULL(vd, dir->priv, VMOD_UNIDIRECTORS_DIRECTOR_MAGIC);
 
-	udir_rdlock(vd);
+	snap = udir_enter(vd);
 	if (changed != NULL)
 		*changed = 0;
-	for (u = 0; u < vd->n_backend; u++) {
-		be = vd->backend[u];
+	for (u = 0; u < snap->n_backend; u++) {
+		be = snap->backend[u];
 		CHECK_OBJ_NOTNULL(be, DIRECTOR_MAGIC);
 		retval = VRT_Healthy(ctx, be, &c);
 		if (changed != NULL && c > *changed)
@@ -185,7 +771,7 @@ udir_vdi_healthy(VRT_CTX, VCL_BACKEND dir, VCL_TIME *changed)
 		if (retval)
 			break;
 	}
-	udir_unlock(vd);
+	udir_leave(vd);
 	return (retval);
 }
 
@@ -193,6 +779,7 @@ void v_matchproto_(vdi_list_f)
 udir_vdi_list(VRT_CTX, VCL_BACKEND dir, struct vsb *vsb, int pflag, int jflag)
 {
 	struct vmod_unidirectors_director *vd;
+	const struct udir_snapshot *snap;
 	VCL_BACKEND be;
 	VCL_BOOL h;
 	unsigned u, nh = 0;
@@ -203,17 +790,17 @@ udir_vdi_list(VRT_CTX, VCL_BACKEND dir, struct vsb *vsb, int pflag, int jflag)
 	CHECK_OBJ_NOTNULL(dir, DIRECTOR_MAGIC);
 	CAST_OBJ_NOTNULL(vd, dir->priv, VMOD_UNIDIRECTORS_DIRECTOR_MAGIC);
 
-	udir_rdlock(vd);
+	snap = udir_enter(vd);
 	if (pflag)
-		healthy = vbit_new(vd->n_backend);
-	for (u = 0; u < vd->n_backend; u++) {
-		be = vd->backend[u];
+		healthy = vbit_new(snap->n_backend);
+	for (u = 0; u < snap->n_backend; u++) {
+		be = snap->backend[u];
 		CHECK_OBJ_NOTNULL(be, DIRECTOR_MAGIC);
 
-		h = VRT_Healthy(ctx, vd->backend[u], NULL);
+		h = VRT_Healthy(ctx, snap->backend[u], NULL);
 		if (h) {
 			nh++;
-			tw += vd->weight[u];
+			tw += snap->weight[u];
 			if (healthy)
 				vbit_set(healthy, u);
 		}
@@ -229,11 +816,11 @@ udir_vdi_list(VRT_CTX, VCL_BACKEND dir, struct vsb *vsb, int pflag, int jflag)
 			VSB_cat(vsb, "\n\n\tBackend\tWeight\tHealth\n");
 		}
 	}
-	for (u = 0; pflag && u < vd->n_backend; u++) {
-		be = vd->backend[u];
+	for (u = 0; pflag && u < snap->n_backend; u++) {
+		be = snap->backend[u];
 		AN(healthy);
 		h = vbit_test(healthy, u);
-		w = h ? vd->weight[u] : 0.0;
+		w = h ? snap->weight[u] : 0.0;
 
 		if (jflag) {
 			if (u)
@@ -256,8 +843,8 @@ udir_vdi_list(VRT_CTX, VCL_BACKEND dir, struct vsb *vsb, int pflag, int jflag)
 			VSB_cat(vsb, "\n");
 		}
 	}
-	u = vd->n_backend;
-	udir_unlock(vd);
+	u = snap->n_backend;
+	udir_leave(vd);
 	vbit_destroy(healthy);
 
 	if (jflag && (pflag)) {
@@ -278,26 +865,30 @@ udir_vdi_list(VRT_CTX, VCL_BACKEND dir, struct vsb *vsb, int pflag, int jflag)
 		VSB_printf(vsb, "%u/%u\t%s", nh, u, nh ? "healthy" : "sick");
 }
 
+#ifdef HAVE_STRUCT_VDI_METHODS_FIND
 VCL_BACKEND v_matchproto_(vdi_find_f)
 udir_vdi_find(VCL_BACKEND dir, const struct suckaddr *sa,
 	      int (*cmp)(const struct suckaddr *, const struct suckaddr *))
 {
         unsigned u;
 	struct vmod_unidirectors_director *vd;
+	const struct udir_snapshot *snap;
 	VCL_BACKEND be, rbe = NULL;
 
 	CAST_OBJ_NOTNULL(vd, dir->priv, VMOD_UNIDIRECTORS_DIRECTOR_MAGIC);
-	udir_rdlock(vd);
-	for (u = 0; u < vd->n_backend && rbe == NULL; u++) {
-	        be = vd->backend[u];
+	snap = udir_enter(vd);
+	for (u = 0; u < snap->n_backend && rbe == NULL; u++) {
+	        be = snap->backend[u];
 		CHECK_OBJ_NOTNULL(be, DIRECTOR_MAGIC);
 		if (be->vdir->methods->find)
 		        rbe = be->vdir->methods->find(be, sa, cmp);
 	}
-	udir_unlock(vd);
+	udir_leave(vd);
 	return (rbe);
 }
+#endif
 
+#ifdef HAVE_STRUCT_VDI_METHODS_UPTIME
 VCL_BOOL v_matchproto_(vdi_uptime_f)
 udir_vdi_uptime(VRT_CTX, VCL_BACKEND dir, VCL_TIME *changed, double *load)
 {
@@ -305,6 +896,7 @@ udir_vdi_uptime(VRT_CTX, VCL_BACKEND dir, VCL_TIME *changed, double *load)
 	double sum = 0.0, tw = 0.0;
 	double c, l, tl = 0;
 	struct vmod_unidirectors_director *vd;
+	const struct udir_snapshot *snap;
 	VCL_BACKEND be = NULL;
 	unsigned retval = 0;
 
@@ -312,25 +904,26 @@ udir_vdi_uptime(VRT_CTX, VCL_BACKEND dir, VCL_TIME *changed, double *load)
 	CHECK_OBJ_NOTNULL(dir, DIRECTOR_MAGIC);
 	CAST_OBJ_NOTNULL(vd, dir->priv, VMOD_UNIDIRECTORS_DIRECTOR_MAGIC);
 
-	udir_rdlock(vd);
-	for (u = 0; u < vd->n_backend; u++) {
-		be = vd->backend[u];
+	snap = udir_enter(vd);
+	for (u = 0; u < snap->n_backend; u++) {
+		be = snap->backend[u];
 		CHECK_OBJ_NOTNULL(be, DIRECTOR_MAGIC);
 		AN(be->vdir->methods->uptime);
 		if (be->vdir->methods->uptime(ctx, be, &c, &l)) {
 			retval = 1;
-			sum += c * vd->weight[u];
-			tw += vd->weight[u];
+			sum += c * snap->weight[u];
+			tw += snap->weight[u];
 			tl += l;
 		}
 	}
-	udir_unlock(vd);
+	udir_leave(vd);
 	if (changed != NULL)
 		*changed = (tw > 0.0 ? sum / tw : 0);
 	if (load != NULL)
 		*load = tl;
 	return (retval);
 }
+#endif
 
 VCL_VOID v_matchproto_()
 vmod_director__init(VRT_CTX, struct vmod_unidirectors_director **vdp, const char *vcl_name)
@@ -346,11 +939,18 @@ vmod_director__fini(struct vmod_unidirectors_director **vdp)
 }
 
 VCL_VOID v_matchproto_()
-vmod_director_add_backend(VRT_CTX, struct vmod_unidirectors_director *vd, VCL_BACKEND be, double w)
+vmod_director_add_backend(VRT_CTX, struct vmod_unidirectors_director *vd, VCL_BACKEND be, double w,
+			  VCL_INT priority)
 {
 	CHECK_OBJ_NOTNULL(ctx, VRT_CTX_MAGIC);
+	if (priority < 0) {
+		VRT_fail(ctx, "%s: negative priority", vd->vcl_name);
+		return;
+	}
 	udir_wrlock(vd);
-	(void)_udir_add_backend(ctx, vd, be, w);
+	if (_udir_add_backend(ctx, vd, be, w, priority) &&
+	    ctx->method == VCL_MET_INIT)
+		vd->lazy = 1;
 	udir_unlock(vd);
 }
 
@@ -31,31 +31,159 @@
  * SUCH DAMAGE.
  */
 
-/* number of backend per director limit to 256 per default */
-typedef uint8_t be_idx_t;
-#define UDIR_MAX_BACKEND (1 << sizeof(be_idx_t) * 8)
+/* number of backend per director, can be lowered at build time */
+typedef uint32_t be_idx_t;
+#ifndef UDIR_MAX_BACKEND
+#define UDIR_MAX_BACKEND (1U << 20)
+#endif
+
+typedef void udir_epoch_free_f(void *);
+
+/*
+ * Per backend statistics of a director: requests in flight and a peak
+ * EWMA of their duration. Shared by the snapshots and by the fetch tasks
+ * still using the backend, hence refcounted. Cache line aligned.
+ */
+struct udir_stat {
+	unsigned				magic;
+#define UDIR_STAT_MAGIC				0x1f6b0d94
+	unsigned				refcnt;
+	unsigned				inflight;
+	pthread_mutex_t				mtx;	/* ewma writers */
+	unsigned				seq;	/* ewma readers */
+	double					ewma;	/* seconds */
+	double					t_ewma;
+} __attribute__((aligned(64)));
+
+/*
+ * Immutable view of the backends published to the resolvers.
+ * Writers work on the director arrays under mtx, a new snapshot is
+ * published on unlock and the old one is reclaimed by epoch.
+ */
+struct udir_snapshot {
+	unsigned				magic;
+#define UDIR_SNAPSHOT_MAGIC			0x3b9e54d1
+	unsigned				gen;
+	unsigned				n_backend;
+	VCL_BACKEND				*backend;
+	double					*weight;
+	unsigned				*priority;
+	struct udir_stat			**stat;
+	unsigned				uniform; /* same weight > 0 */
+
+	unsigned				built;	/* priv is set */
+	void					*priv;	/* LB method data */
+	udir_epoch_free_f			*priv_free;
+};
+
+/*
+ * Healthy backends of a snapshot, cached to keep VRT_Healthy() off the
+ * resolve path. It is rebuilt when a new snapshot is published, when a
+ * resolver finds its pick sick (health_gen bump) or after
+ * UDIR_HEALTHY_TTL seconds to notice backends coming back to health.
+ */
+#define UDIR_HEALTHY_TTL			1.0
+
+struct udir_healthy {
+	unsigned				magic;
+#define UDIR_HEALTHY_MAGIC			0x6c0a29e7
+	unsigned				gen;
+	unsigned				health_gen;
+	double					t_built;
+	unsigned				n_backend;
+	double					tw;
+	double					*cw;	/* cumulative weights */
+	be_idx_t				*be_idx;
+	uint32_t				*bitmap; /* by snapshot index */
+
+	void					*priv;	/* LB method data */
+	udir_epoch_free_f			*priv_free;
+};
+
+#define udir_healthy_test(hs, u) \
+	((hs)->bitmap[(u) >> 5] & (1U << ((u) & 31)))
+
+/*
+ * One change of a batch applied by _udir_change_backends(): remove be,
+ * or set its weight and priority, appending it when absent.
+ */
+struct udir_change {
+	VCL_BACKEND				be;
+	double					weight;
+	unsigned				priority;
+	unsigned				remove;
+	unsigned				done;	/* out */
+};
+
+struct vmod_unidirectors_director;
+typedef void *udir_snapshot_build_f(const struct vmod_unidirectors_director *,
+				    const struct udir_snapshot *);
+/* NULL for a set of positive weight is a failed build */
+typedef void *udir_healthy_build_f(const struct vmod_unidirectors_director *,
+				   const struct udir_snapshot *,
+				   const struct udir_healthy *);
 
 struct vmod_unidirectors_director {
 	unsigned				magic;
 #define VMOD_UNIDIRECTORS_DIRECTOR_MAGIC	0x82c52b08
-	pthread_rwlock_t			mtx;
+	pthread_mutex_t				mtx;
 	unsigned				n_backend;
 	unsigned				l_backend;
 	VCL_BACKEND				*backend;
 	double					*weight;
+	unsigned				*priority;
+	struct udir_stat			**stat;
+	unsigned				inflight;	/* bounded hash */
+	unsigned				dirty;
+	unsigned				lazy;	/* vcl_init, see udir_enter() */
+	unsigned				gen;
+	struct udir_snapshot			*snapshot;
+	udir_snapshot_build_f			*snapshot_build;
+	udir_epoch_free_f			*snapshot_free;
+
+	pthread_mutex_t				hmtx;
+	unsigned				health_gen;
+	struct udir_healthy			*healthy;
+	udir_healthy_build_f			*healthy_build;
+	udir_epoch_free_f			*healthy_free;
 	const char				*vcl_name;
 	VCL_BACKEND				dir;
 
         void					*priv;
 };
 
-void udir_rdlock(struct vmod_unidirectors_director*vd);
+void udir_epoch_init(void);
+void udir_epoch_fini(void);
+void udir_epoch_enter(void);
+void udir_epoch_leave(void);
+void udir_epoch_retire(void *, udir_epoch_free_f *);
+
+double udir_random(void);
+
+const struct udir_snapshot *udir_enter(struct vmod_unidirectors_director *vd);
+void udir_leave(struct vmod_unidirectors_director *vd);
+const struct udir_healthy *udir_healthy_get(VRT_CTX, struct vmod_unidirectors_director *vd,
+					    const struct udir_snapshot *snap);
+unsigned udir_healthy_pick(const struct udir_healthy *hs, double r);
+const struct udir_healthy *udir_healthy_update(VRT_CTX, struct vmod_unidirectors_director *vd,
+					       const struct udir_snapshot *snap,
+					       const struct udir_healthy *hs);
+void udir_stat_ewma(const struct udir_stat *st, double *ewma, double *t);
+void udir_task_track(VRT_CTX, const struct vmod_unidirectors_director *vd,
+		     struct udir_stat *st, double decay, unsigned *total);
 void udir_wrlock(struct vmod_unidirectors_director*vd);
 void udir_unlock(struct vmod_unidirectors_director*vd);
 unsigned _udir_remove_backend(VRT_CTX, struct vmod_unidirectors_director *vd, VCL_BACKEND be);
-unsigned _udir_add_backend(VRT_CTX, struct vmod_unidirectors_director *vd, VCL_BACKEND be, double weight);
+unsigned _udir_add_backend(VRT_CTX, struct vmod_unidirectors_director *vd, VCL_BACKEND be, double weight,
+			   unsigned priority);
+void _udir_change_backends(VRT_CTX, struct vmod_unidirectors_director *vd,
+			   struct udir_change *chg, unsigned n);
+#ifdef HAVE_STRUCT_VDI_METHODS_FIND
 VCL_BACKEND udir_vdi_find(VCL_BACKEND, const struct suckaddr *sa,
 			  int (*cmp)(const struct suckaddr *, const struct suckaddr *));
+#endif
+#ifdef HAVE_STRUCT_VDI_METHODS_UPTIME
 VCL_BOOL udir_vdi_uptime(VRT_CTX, VCL_BACKEND, VCL_TIME *changed, double *load);
+#endif
 VCL_BOOL udir_vdi_healthy(VRT_CTX, VCL_BACKEND, VCL_TIME *changed);
 void udir_vdi_list(VRT_CTX, VCL_BACKEND, struct vsb *vsb, int pflag, int jflag);
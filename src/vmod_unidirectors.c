@@ -53,8 +53,12 @@ vmod_find_backend(VRT_CTX, VCL_BACKEND be, VCL_IP sa)
 	if (be == NULL)
 	       return (NULL);
 	CHECK_OBJ_NOTNULL(be, DIRECTOR_MAGIC);
+#ifdef HAVE_STRUCT_VDI_METHODS_FIND
 	if (be->vdir->methods->find)
 	       return (be->vdir->methods->find(be, sa, VSA_Compare_IP));
+#else
+	(void)sa;
+#endif
 	return (NULL);
 }
 